@@ -237,7 +237,13 @@ consoleread(struct inode *ip, char *dst, int n)
 {
   uint target;
   int c;
+  char buf[INPUT_BUF], *p;
 
+  // user memory may fault and sleep, so it is written only
+  // after cons.lock is released
+  if(n > sizeof(buf))
+    n = sizeof(buf);
+  p = buf;
   iunlock(ip);
   target = n;
   acquire(&cons.lock);
@@ -259,12 +265,13 @@ consoleread(struct inode *ip, char *dst, int n)
       }
       break;
     }
-    *dst++ = c;
+    *p++ = c;
     --n;
     if(c == '\n')
       break;
   }
   release(&cons.lock);
+  memmove(dst, buf, target - n);
   ilock(ip);
 
   return target - n;
@@ -273,13 +280,19 @@ consoleread(struct inode *ip, char *dst, int n)
 int
 consolewrite(struct inode *ip, char *buf, int n)
 {
-  int i;
+  int i, j, m;
+  char kbuf[128];
 
   iunlock(ip);
-  acquire(&cons.lock);
-  for(i = 0; i < n; i++)
-    consputc(buf[i] & 0xff);
-  release(&cons.lock);
+  // copied in before cons.lock is taken, as user memory may fault
+  for(i = 0; i < n; i += m){
+    m = n - i < sizeof(kbuf) ? n - i : sizeof(kbuf);
+    memmove(kbuf, buf + i, m);
+    acquire(&cons.lock);
+    for(j = 0; j < m; j++)
+      consputc(kbuf[j] & 0xff);
+    release(&cons.lock);
+  }
   ilock(ip);
 
   return n;
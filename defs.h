@@ -2,9 +2,11 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct memstat;
 struct pipe;
 struct proc;
 struct rtcdate;
+struct slabcache;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -33,6 +35,7 @@ void            fileinit(void);
 int             fileread(struct file*, char*, int n);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
+int             filewriteat(struct file*, char*, uint off, int n);
 
 // fs.c
 void            readsb(int dev, struct superblock *sb);
@@ -68,10 +71,20 @@ extern uchar    ioapicid;
 void            ioapicinit(void);
 
 // kalloc.c
+extern uint     phystop;
 char*           kalloc(void);
+char*           kallocblock(int);
+char*           kallocz(void);
+void            kallocdump(void);
+void            kdup(char*);
 void            kfree(char*);
+void            kfreeblock(char*, int);
+uint            kfreepages(void);
+void            frametouch(uint);
+int             kzerofill(void);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+void            meminit(void);
 
 // kbd.c
 void            kbdintr(void);
@@ -83,6 +96,7 @@ extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
 void            lapicstartap(uchar, uint);
+void            lapicipi(uchar, int);
 void            microdelay(int);
 
 // log.c
@@ -102,24 +116,34 @@ void            picinit(void);
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
+void            pipeinit(void);
 int             piperead(struct pipe*, char*, int);
 int             pipewrite(struct pipe*, char*, int);
 
 //PAGEBREAK: 16
 // proc.c
+int             clone(uint, uint, uint);
 int             cpuid(void);
 void            exit(void);
 int             fork(void);
 int             growproc(int);
+void            boostall(void);
+int             join(uint*);
 int             kill(int);
+int             memstat(int, struct memstat*);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
 void            procdump(void);
+int             quantumdone(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+int             setaffinity(int, uint);
+int             settickets(int);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
+int             sleepuntil(uint);
+void            timertick(uint);
 void            userinit(void);
 int             wait(void);
 void            wakeup(void*);
@@ -133,6 +157,11 @@ void            swtch(struct context**, struct context*);
 struct inode*	create(char *path, short type, short major, short minor);
 int				isdirempty(struct inode *dp);
 
+// slab.c
+void*           slaballoc(struct slabcache*);
+void            slabfree(struct slabcache*, void*);
+void            slabinit(struct slabcache*, char*, uint);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
@@ -172,6 +201,7 @@ void            timerinit(void);
 // trap.c
 void            idtinit(void);
 extern uint     ticks;
+extern uint     pressuremax;
 void            tvinit(void);
 extern struct spinlock tickslock;
 
@@ -194,9 +224,20 @@ pde_t*          copyuvm(pde_t*, uint);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
-void            clearpteu(pde_t *pgdir, char *uva);
-void            handlePageFault(uint);
+int             handlePageFault(uint);
+void            lockvm(void);
+void            unlockvm(void);
+void            tlbintr(void);
+int             madvise(uint, uint, int);
+int             mmap(uint, uint, int, int, struct file*, uint);
+int             munmap(uint, uint);
+int             forkVmas(struct proc*, struct proc*);
+void            freeVmas(struct proc*, pde_t*);
+int             initVmas(struct proc*, uint);
+int             setBreak(struct proc*, uint);
+uint            vmaEnd(struct proc*, uint);
 int             checkAndClearFlag(char *va,int clear,int flag);
+void            memusage(pde_t*, struct memstat*);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
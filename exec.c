@@ -2,21 +2,29 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 #include "x86.h"
 #include "elf.h"
+#include "mman.h"
 
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nvma;
   uint argc, sz, sp, ustack[3+MAXARG+1];
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma vmas[NVMA], *v;
   pde_t *pgdir, *oldpgdir;
+
+  // other threads would be left running in the old image
+  if(myproc()->leader != myproc() || myproc()->nthreads > 0)
+    return -1;
   begin_op();
   if((ip = namei(path)) == 0){
     end_op();
@@ -24,6 +32,7 @@ exec(char *path, char **argv)
   }
   ilock(ip);
   pgdir = 0;
+  nvma = 0;
 
  
   
@@ -79,21 +88,47 @@ exec(char *path, char **argv)
       continue;
     if(ph.memsz < ph.filesz)
       goto bad;
+    // segments become regions, which must not overlap
+    if(ph.vaddr % PGSIZE != 0 || ph.vaddr < sz || nvma == NVMA - 2)
+      goto bad;
     if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
       goto bad;
     if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
       goto bad;
+    v = &vmas[nvma++];
+    memset(v, 0, sizeof(*v));
+    v->start = ph.vaddr;
+    v->end = PGROUNDUP(ph.vaddr + ph.memsz);
+    v->kind = VMA_TEXT;
+    v->prot = PROT_READ;
+    if(ph.flags & ELF_PROG_FLAG_WRITE){
+      v->kind = VMA_DATA;
+      v->prot |= PROT_WRITE;
+    }
+    v->ip = idup(ip);
+    v->off = ph.off;
+    v->filesz = ph.filesz;
   }
   iunlockput(ip);
   end_op();
   ip = 0;
-  // Allocate two pages at the next page boundary.
-  // Make the first inaccessible.  Use the second as the user stack.
+  // Leave a page at the next page boundary unmapped, to catch
+  // stack overflows. Allocate the one after it as the user stack.
   sz = PGROUNDUP(sz);
-  if((sz = allocuvm(pgdir, sz, sz + 2*PGSIZE)) == 0)
+  if((sz = allocuvm(pgdir, sz + PGSIZE, sz + 2*PGSIZE)) == 0)
     goto bad;
-  clearpteu(pgdir, (char*)(sz - 2*PGSIZE));
   sp = sz;
+  v = &vmas[nvma++];
+  memset(v, 0, sizeof(*v));
+  v->start = sz - PGSIZE;
+  v->end = sz;
+  v->kind = VMA_STACK;
+  v->prot = PROT_READ | PROT_WRITE;
+  // The heap starts out empty, above the stack.
+  v = &vmas[nvma++];
+  *v = vmas[nvma - 2];
+  v->start = sz;
+  v->kind = VMA_HEAP;
 
   // Push argument strings, prepare rest of stack in ustack.
   for(argc = 0; argv[argc]; argc++) {
@@ -120,16 +155,22 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(proc->name, last, sizeof(proc->name));
 
-  // Commit to the user image.
+  // Commit to the user image. memstat() walks proc->pgdir under
+  // proc->lock, so the old one is freed only once it is swapped.
+  acquire(&proc->lock);
   oldpgdir = proc->pgdir;
   proc->pgdir = pgdir;
+  release(&proc->lock);
   proc->sz = sz;
   proc->tf->eip = elf.entry;  // main
   proc->tf->esp = sp;
-  // a swap file has been created in fork(), but its content was of the
-  // parent process, and is no longer relevant.
+  memset(proc->madv, 0, sizeof(proc->madv));
+  freeVmas(proc, oldpgdir);
+  memmove(proc->vmas, vmas, nvma * sizeof(vmas[0]));
+  proc->nvma = nvma;
+  // the swap file, if any, holds pages of the old image and is no
+  // longer relevant; a new one is created on the next swap-out.
   removeSwapFile(proc);
-  createSwapFile(proc);
   switchuvm(proc);
   freevm(oldpgdir);
   //cprintf("no. of pages allocated on exec:%d, pid:%d, name:%s\n", proc->pagesInRAM, proc->pid, proc->name);
@@ -143,6 +184,11 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  begin_op();
+  for(v = vmas; v < &vmas[nvma]; v++)
+    if(v->ip)
+      iput(v->ip);
+  end_op();
 #ifndef NONE
   proc->pagesInRAM = pagesInRAM;
   proc->pagesInSwap = pagesInSwap;
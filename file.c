@@ -5,39 +5,40 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "stat.h"
+#include "memlayout.h"
+#include "mmu.h"
 #include "fs.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
 struct {
-  struct spinlock lock;
-  struct file file[NFILE];
+  struct spinlock lock;  // protects every f->ref
 } ftable;
 
+static struct slabcache filecache;
+
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  slabinit(&filecache, "file", sizeof(struct file));
 }
 
-// Allocate a file structure.
+// Allocate a file structure from the slab cache.
 struct file*
 filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = (struct file*)slaballoc(&filecache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -66,9 +67,8 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  slabfree(&filecache, f);
 
   if(ff.type == FD_PIPE)
     pipeclose(ff.pipe, ff.writable);
@@ -83,31 +83,63 @@ fileclose(struct file *f)
 int
 filestat(struct file *f, struct stat *st)
 {
+  struct stat kst;
+
   if(f->type == FD_INODE){
+    // st is user memory: store to it only once f->ip is unlocked
     ilock(f->ip);
-    stati(f->ip, st);
+    stati(f->ip, &kst);
     iunlock(f->ip);
+    *st = kst;
     return 0;
   }
   return -1;
 }
 
+// Read up to n bytes of inode file f at f->off into dst.
+static int
+inoderead(struct file *f, char *dst, int n)
+{
+  int r;
+
+  ilock(f->ip);
+  if((r = readi(f->ip, dst, f->off, n)) > 0)
+    f->off += r;
+  iunlock(f->ip);
+  return r;
+}
+
 // Read from file f.
 int
 fileread(struct file *f, char *addr, int n)
 {
-  int r;
+  int r, i, m;
+  char *buf;
 
   if(f->readable == 0)
     return -1;
   if(f->type == FD_PIPE)
     return piperead(f->pipe, addr, n);
   if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
-    return r;
+    // A fault on user memory may lock the inode of a mapped file,
+    // so it is copied out from a kernel page once f->ip is
+    // unlocked. Kernel buffers, like the swap file's, cannot fault.
+    if((uint)addr >= KERNBASE)
+      return inoderead(f, addr, n);
+    if((buf = kalloc()) == 0)
+      return -1;
+    for(i = r = 0; i < n; i += r){
+      m = n - i < PGSIZE ? n - i : PGSIZE;
+      if((r = inoderead(f, buf, m)) <= 0)
+        break;
+      memmove(addr + i, buf, r);
+      if(r < m){  // end of file, or all a device had
+        i += r;
+        break;
+      }
+    }
+    kfree(buf);
+    return i > 0 ? i : r;
   }
   panic("fileread");
 }
@@ -132,14 +164,21 @@ filewrite(struct file *f, char *addr, int n)
     // might be writing a device like the console.
     int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
     int i = 0;
+    // as in fileread, user memory is copied in through a kernel
+    // page before the inode is locked and the transaction begun
+    char *buf = 0;
+    if((uint)addr < KERNBASE && (buf = kalloc()) == 0)
+      return -1;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
+      if(buf)
+        memmove(buf, addr + i, n1);
       begin_op();
       ilock(f->ip);
-      if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
+      if ((r = writei(f->ip, buf ? buf : addr + i, f->off, n1)) > 0)
         f->off += r;
       iunlock(f->ip);
       end_op();
@@ -150,8 +189,35 @@ filewrite(struct file *f, char *addr, int n)
         panic("short filewrite");
       i += r;
     }
+    if(buf)
+      kfree(buf);
     return i == n ? n : -1;
   }
   panic("filewrite");
 }
 
+// Write n bytes at offset off of inode file f.
+// Unlike filewrite, leaves f->off alone.
+int
+filewriteat(struct file *f, char *addr, uint off, int n)
+{
+  int r, max, i, n1;
+
+  if(f->writable == 0 || f->type != FD_INODE)
+    return -1;
+  // same transaction size limit as filewrite
+  max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
+  for(i = 0; i < n; i += r){
+    n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+    begin_op();
+    ilock(f->ip);
+    r = writei(f->ip, addr + i, off + i, n1);
+    iunlock(f->ip);
+    end_op();
+    if(r != n1)
+      return -1;
+  }
+  return n;
+}
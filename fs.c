@@ -14,9 +14,9 @@
 #include "param.h"
 #include "stat.h"
 #include "mmu.h"
-#include "proc.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "proc.h"
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
@@ -295,6 +295,7 @@ ilock(struct inode *ip)
     panic("ilock");
 
   acquiresleep(&ip->lock);
+  myproc()->ilocks++;
 
   if(ip->valid == 0){
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
@@ -319,6 +320,7 @@ iunlock(struct inode *ip)
   if(ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
     panic("iunlock");
 
+  myproc()->ilocks--;
   releasesleep(&ip->lock);
 }
 
@@ -626,6 +628,7 @@ static struct inode*
 namex(char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
+  int last;
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
@@ -633,12 +636,14 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    // path may be user memory, not to be read with ip locked
+    last = *path == '\0';
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
       return 0;
     }
-    if(nameiparent && *path == '\0'){
+    if(nameiparent && last){
       // Stop one level early.
       iunlock(ip);
       return ip;
@@ -694,7 +699,7 @@ char* itoa(int i, char b[]){
     }while(i);
     return b;
 }
-//remove swap file of proc p;
+//remove swap file of proc p, if it has one;
 int
 removeSwapFile(struct proc* p)
 {
@@ -710,9 +715,10 @@ removeSwapFile(struct proc* p)
 
   if(0 == p->swapFile)
   {
-    return -1;
+    return 0;
   }
   fileclose(p->swapFile);
+  p->swapFile = 0;
 
   begin_op();
   if((dp = nameiparent(path, name)) == 0)
@@ -791,9 +797,13 @@ createSwapFile(struct proc* p)
 }
 
 //return as sys_write (-1 when error)
+//the swap file is created on the first write, so that a process
+//which never swaps holds no file or inode slot
 int
 writeToSwapFile(struct proc * p, char* buffer, uint placeOnFile, uint size)
 {
+  if(p->swapFile == 0 && createSwapFile(p) != 0)
+    return -1;
   p->swapFile->off = placeOnFile;
 
   return filewrite(p->swapFile, buffer, size);
@@ -804,6 +814,8 @@ writeToSwapFile(struct proc * p, char* buffer, uint placeOnFile, uint size)
 int
 readFromSwapFile(struct proc * p, char* buffer, uint placeOnFile, uint size)
 {
+  if(p->swapFile == 0)
+    return 0;
   p->swapFile->off = placeOnFile;
 
   return fileread(p->swapFile, buffer,  size);
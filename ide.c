@@ -5,11 +5,11 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
-#include "spinlock.h"
-#include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
 
@@ -159,9 +159,11 @@ iderw(struct buf *b)
     idestart(b);
 
   // Wait for request to finish.
+  myproc()->diskwait = 1;
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
     sleep(b, &idelock);
   }
+  myproc()->diskwait = 0;
 
 
   release(&idelock);
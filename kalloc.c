@@ -1,6 +1,7 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
-// and pipe buffers. Allocates 4096-byte pages.
+// and pipe buffers. Allocates 4096-byte pages, and blocks of
+// 2^order contiguous pages for order up to KMAXORDER.
 
 #include "types.h"
 #include "defs.h"
@@ -17,14 +18,90 @@ extern char end[]; // first address after kernel loaded from ELF file
 
 struct run {
   struct run *next;
+  struct run *prev;     // used on the buddy lists only
 };
 
+// Buddy allocator. A free block of order k is 2^k pages, aligned
+// to its own size in physical memory. Its buddy is the other half
+// of the block of order k+1 it belongs to; when both are free they
+// are merged back into that block.
 struct {
   struct spinlock lock;
   int use_lock;
-  struct run *freelist;
+  struct run free[KMAXORDER+1]; // list heads of free blocks, by order
+  int nfree[KMAXORDER+1];       // blocks on each list
+  uchar order[PHYSMAX/PGSIZE];  // 1 + order of the free block at each frame, or 0
 } kmem;
 
+struct frame *frames;  // one per frame below phystop, set up by kinit2
+
+// Per-CPU caches of free pages. Once kinit2 turns on locking,
+// kalloc() and kfree() work on the cache of the CPU they run on,
+// with interrupts off, and take kmem.lock only to move KBATCH
+// pages at a time between it and the buddy lists.
+struct kcache {
+  struct run *freelist;
+  int n;                // pages on freelist
+} kcache[NCPU];
+
+// Pages zeroed ahead of time by idle CPUs, for kallocz().
+struct {
+  struct spinlock lock;
+  struct run *freelist;
+  int n;                // pages on freelist
+} kzero;
+
+uint phystop;  // Top physical memory
+
+// An entry of the memory map bootasm.S got from the BIOS.
+struct e820entry {
+  uint addr, addrhi;
+  uint len, lenhi;
+  uint type;
+};
+
+#define E820_RAM 1  // usable memory
+
+// Set phystop to the end of the RAM that starts at EXTMEM,
+// according to the BIOS memory map, but at most PHYSMAX.
+// Must be called before anything uses phystop.
+void
+meminit(void)
+{
+  struct e820entry *e, *ee;
+  uint top;
+  int grown;
+
+  e = (struct e820entry*)P2V(E820MAP + 4);
+  ee = e + *(ushort*)P2V(E820MAP) / sizeof(*e);
+  if(e == ee){
+    phystop = PHYSDEF;
+    return;
+  }
+  // the entries need not be sorted: follow them up from EXTMEM
+  top = EXTMEM;
+  do {
+    grown = 0;
+    for(e = (struct e820entry*)P2V(E820MAP + 4); e < ee; e++){
+      if(e->type != E820_RAM || e->addrhi != 0 || e->addr > top)
+        continue;
+      if(e->lenhi != 0 || e->addr + e->len < e->addr){
+        top = PHYSMAX;    // runs past 4GB
+        break;
+      }
+      if(e->addr + e->len > top){
+        top = e->addr + e->len;
+        grown = 1;
+      }
+    }
+  } while(grown && top < PHYSMAX);
+  if(top > PHYSMAX)
+    top = PHYSMAX;
+  phystop = PGROUNDDOWN(top);
+  if(phystop < 4*1024*1024)
+    panic("meminit: less than 4MB of memory");
+}
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -33,61 +110,292 @@ struct {
 void
 kinit1(void *vstart, void *vend)
 {
+  int k;
+
   initlock(&kmem.lock, "kmem");
+  initlock(&kzero.lock, "kzero");
   kmem.use_lock = 0;
+  for(k = 0; k <= KMAXORDER; k++)
+    kmem.free[k].next = kmem.free[k].prev = &kmem.free[k];
   freerange(vstart, vend);
 
   // physicalPagesCounts is a struct defined in ppgc.h to hold info needed to cumpute percent of free physcal pages
   // all physical pages allocated to the kernel's allocator's "freelist" are allocated in kinit1 & kinit2
   // here we update the # of pages inserted to free list in kinit1
   physicalPagesCounts.totalFreePages = (PGROUNDDOWN((uint)vend) - PGROUNDUP((uint)vstart)) / PGSIZE;
-  
+
 }
 
 void
 kinit2(void *vstart, void *vend)
 {
+  uint n;
+  int k;
+
   freerange(vstart, vend);
   // update the # of pages inserted to free list in kinit2
   physicalPagesCounts.totalFreePages += (PGROUNDDOWN((uint)vend) - PGROUNDUP((uint)vstart)) / PGSIZE;
+
+  // frame descriptors, sized for the memory meminit found
+  n = phystop / PGSIZE * sizeof(struct frame);
+  for(k = 0; (PGSIZE << k) < n; k++)
+    ;
+  if((frames = (struct frame*)kallocblock(k)) == 0)
+    panic("kinit2: frames");
+  memset(frames, 0, PGSIZE << k);
+  physicalPagesCounts.totalFreePages -= 1 << k;
   kmem.use_lock = 1;
 }
 
+// Reset the descriptors of the n frames at v as they are handed out.
+static void
+frameinit(char *v, int n, int flags)
+{
+  struct frame *f;
+
+  if(frames == 0)
+    return;
+  for(f = &frames[V2P(v) / PGSIZE]; n > 0; n--, f++){
+    f->owner = 0;
+    f->mapcount = 1;
+    f->flags = flags;
+    f->epoch = 0;
+  }
+}
+
+// Record what page table entry pte tells about its frame:
+// accessed bits move the epoch on, dirty bits stick.
+void
+frametouch(uint pte)
+{
+  struct frame *f;
+
+  if(frames == 0 || (pte & PTE_P) == 0 || PTE_ADDR(pte) >= phystop)
+    return;
+  f = &frames[PTE_ADDR(pte) / PGSIZE];
+  if(pte & PTE_A)
+    f->epoch = ticks;
+  if(pte & PTE_D)
+    f->flags = (f->flags | FRAME_DIRTY) & ~FRAME_ZEROED;
+}
+
+// Return the number of free pages, counting the pages in every
+// CPU's cache. A snapshot, for statistics.
+uint
+kfreepages(void)
+{
+  struct kcache *c;
+  uint n;
+  int k;
+
+  n = 0;
+  for(k = 0; k <= KMAXORDER; k++)
+    n += kmem.nfree[k] << k;
+  for(c = kcache; c < &kcache[NCPU]; c++)
+    n += c->n;
+  return n + kzero.n;
+}
+
+// Print the free blocks of each order, and how much of the free
+// memory is cut up into blocks smaller than KMAXORDER.
+void
+kallocdump(void)
+{
+  uint n;
+  int k;
+
+  cprintf("free blocks by order:");
+  for(k = 0; k <= KMAXORDER; k++)
+    cprintf(" %d", kmem.nfree[k]);
+  n = kfreepages();
+  if(n > 0)
+    cprintf("; %d%% of free pages outside %dKB blocks",
+            100 - (kmem.nfree[KMAXORDER] << KMAXORDER) * 100 / n,
+            (PGSIZE << KMAXORDER) / 1024);
+  cprintf("\n");
+}
+
+static void
+pushblock(struct run *r, int k)
+{
+  struct run *h = &kmem.free[k];
+
+  r->next = h->next;
+  r->prev = h;
+  h->next->prev = r;
+  h->next = r;
+  kmem.nfree[k]++;
+  kmem.order[V2P(r) / PGSIZE] = k + 1;
+}
+
+static void
+popblock(struct run *r, int k)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  kmem.nfree[k]--;
+  kmem.order[V2P(r) / PGSIZE] = 0;
+}
+
+// Take a block of order k off the buddy lists, splitting a larger
+// one if need be. Caller holds kmem.lock.
+static struct run*
+buddyalloc(int k)
+{
+  struct run *r;
+  int j;
+
+  for(j = k; j <= KMAXORDER && kmem.nfree[j] == 0; j++)
+    ;
+  if(j > KMAXORDER)
+    return 0;
+  r = kmem.free[j].next;
+  popblock(r, j);
+  // the upper halves go back, one of each order below j
+  while(j > k){
+    j--;
+    pushblock((struct run*)((char*)r + (PGSIZE << j)), j);
+  }
+  return r;
+}
+
+// Put the block of order k at r on the buddy lists, merging it
+// with its buddy for as long as that is free. Caller holds kmem.lock.
+static void
+buddyfree(struct run *r, int k)
+{
+  uint pa, bpa;
+
+  pa = V2P(r);
+  for(; k < KMAXORDER; k++){
+    bpa = pa ^ (PGSIZE << k);
+    if(bpa >= phystop || kmem.order[bpa / PGSIZE] != k + 1)
+      break;
+    popblock(P2V(bpa), k);
+    pa &= ~(PGSIZE << k);
+  }
+  pushblock(P2V(pa), k);
+}
+
+// Move KBATCH pages from the buddy lists to cache c, or as many
+// as are left.
+static void
+refill(struct kcache *c)
+{
+  struct run *r;
+  int i;
+
+  acquire(&kmem.lock);
+  for(i = 0; i < KBATCH && (r = buddyalloc(0)) != 0; i++){
+    r->next = c->freelist;
+    c->freelist = r;
+    c->n++;
+  }
+  release(&kmem.lock);
+}
+
+// Move KBATCH pages from cache c back to the buddy lists.
+static void
+drain(struct kcache *c)
+{
+  struct run *r;
+  int i;
+
+  acquire(&kmem.lock);
+  for(i = 0; i < KBATCH && (r = c->freelist) != 0; i++){
+    c->freelist = r->next;
+    c->n--;
+    buddyfree(r, 0);
+  }
+  release(&kmem.lock);
+}
+
+// Take a page off the pre-zeroed pool, or return 0 if it is empty.
+static char*
+zeropop(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  r = kzero.freelist;
+  if(r){
+    kzero.freelist = r->next;
+    kzero.n--;
+    r->next = 0;
+  }
+  release(&kzero.lock);
+  return (char*)r;
+}
+
+// Put the pages of [vstart, vend) on the buddy lists, as the largest
+// aligned blocks that fit. Only the first word of each block is
+// written, so this takes time in the number of 4MB blocks, not pages.
 void
 freerange(void *vstart, void *vend)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
-    kfree(p);
+  uint pa, end;
+  int k;
+
+  pa = V2P(PGROUNDUP((uint)vstart));
+  end = PGROUNDDOWN(V2P(vend));
+  while(pa < end){
+    for(k = KMAXORDER; k > 0; k--)
+      if(pa % (PGSIZE << k) == 0 && pa + (PGSIZE << k) <= end)
+        break;
+    buddyfree(P2V(pa), k);
+    pa += PGSIZE << k;
+  }
 }
 //PAGEBREAK: 21
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to kalloc().
 void
 kfree(char *v)
 {
   struct run *r;
+  struct kcache *c;
+  struct frame *f;
 
-  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP){
+  if((uint)v % PGSIZE || v < end || V2P(v) >= phystop){
     panic("kfree");
 
   }
 
+  // A frame shared by mmap(MAP_SHARED) is freed by its last user.
+  // Nobody can kdup() a frame whose last user is freeing it, so a
+  // count of one needs no lock.
+  f = frames ? &frames[V2P(v) / PGSIZE] : 0;
+  if(f && f->mapcount > 1){
+    acquire(&kmem.lock);
+    if(f->mapcount > 1){
+      f->mapcount--;
+      v = 0;
+    }
+    release(&kmem.lock);
+    if(v == 0)
+      return;
+  }
+  if(f)
+    memset(f, 0, sizeof(*f));
+
+#ifdef JUNK_FILL
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
+#endif
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-
-  kmem.freelist = r;
-  physicalPagesCounts.currentFreePagesNo++;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  if(!kmem.use_lock){
+    buddyfree(r, 0);
+    return;
+  }
+  pushcli();
+  c = &kcache[cpuid()];
+  r->next = c->freelist;
+  c->freelist = r;
+  if(++c->n >= KCACHE)
+    drain(c);
+  popcli();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -97,15 +405,121 @@ char*
 kalloc(void)
 {
   struct run *r;
+  struct kcache *c;
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
+  if(!kmem.use_lock)
+    return (char*)buddyalloc(0);
+  pushcli();
+  c = &kcache[cpuid()];
+  if(c->freelist == 0)
+    refill(c);
+  r = c->freelist;
   if(r){
-    kmem.freelist = r->next;
-    physicalPagesCounts.currentFreePagesNo--;
+    c->freelist = r->next;
+    c->n--;
   }
+  popcli();
+  // the zeroed pool is the last reserve
+  if(r == 0)
+    r = (struct run*)zeropop();
+  if(r)
+    frameinit((char*)r, 1, 0);
+  return (char*)r;
+}
+
+// Allocate one page of physical memory filled with zeros,
+// from the pre-zeroed pool if it has any.
+// Returns 0 if the memory cannot be allocated.
+char*
+kallocz(void)
+{
+  char *v;
+
+  if(!kmem.use_lock || (v = zeropop()) == 0){
+    if((v = kalloc()) == 0)
+      return 0;
+    memset(v, 0, PGSIZE);
+  }
+  frameinit(v, 1, FRAME_ZEROED);
+  return v;
+}
+
+// Zero a few free pages and add them to the pool for kallocz().
+// Called by idle CPUs. Returns 1 if it did any work.
+int
+kzerofill(void)
+{
+  struct run *r;
+  int i;
+
+  // other CPUs may reach the scheduler while kinit2 still runs
+  if(!kmem.use_lock)
+    return 0;
+  for(i = 0; i < KBATCH && kzero.n < NZEROPG; i++){
+    if((r = (struct run*)kalloc()) == 0)
+      break;
+    memset(r, 0, PGSIZE);
+    acquire(&kzero.lock);
+    r->next = kzero.freelist;
+    kzero.freelist = r;
+    kzero.n++;
+    release(&kzero.lock);
+  }
+  return i > 0;
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size. Returns 0 if no block that large is free.
+char*
+kallocblock(int order)
+{
+  struct run *r;
+
+  if(order < 0 || order > KMAXORDER)
+    panic("kallocblock");
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  r = buddyalloc(order);
   if(kmem.use_lock)
     release(&kmem.lock);
+  if(r)
+    frameinit((char*)r, 1 << order, 0);
   return (char*)r;
 }
+
+// Free a block returned by kallocblock(order). Its pages may
+// instead be freed one by one with kfree().
+void
+kfreeblock(char *v, int order)
+{
+  if(order < 0 || order > KMAXORDER || V2P(v) % (PGSIZE << order) ||
+     v < end || V2P(v) + (PGSIZE << order) > phystop)
+    panic("kfreeblock");
+  if(frames)
+    memset(&frames[V2P(v) / PGSIZE], 0, sizeof(struct frame) << order);
+
+#ifdef JUNK_FILL
+  // Fill with junk to catch dangling refs.
+  memset(v, 1, PGSIZE << order);
+#endif
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  buddyfree((struct run*)v, order);
+  if(kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Add a reference to a frame returned by kalloc(), so that
+// it survives one more kfree().
+void
+kdup(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= phystop)
+    panic("kdup");
+  acquire(&kmem.lock);
+  if(frames[V2P(v) / PGSIZE].mapcount == 0xff)
+    panic("kdup: too many references");
+  frames[V2P(v) / PGSIZE].mapcount++;
+  release(&kmem.lock);
+}
@@ -5,11 +5,11 @@
 #include "defs.h"
 #include "param.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
-#include "spinlock.h"
-#include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
 
@@ -1,8 +1,11 @@
 // Memory layout
 
 #define EXTMEM  0x100000            // Start of extended memory
-#define PHYSTOP 0xE000000           // Top physical memory
+#define E820MAP 0x8000              // BIOS memory map, left by bootasm.S
+#define PHYSMAX 0x40000000          // Most physical memory the kernel uses (see phystop)
+#define PHYSDEF 0xE000000           // Top physical memory if the BIOS gives no map
 #define DEVSPACE 0xFE000000         // Other devices are at high addresses
+#define MMAPBASE 0x40000000         // mmap() regions are placed above the heap limit
 
 // Key addresses for address space layout (see kmap in vm.c for layout)
 #define KERNBASE 0x80000000         // First kernel virtual address
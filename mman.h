@@ -0,0 +1,26 @@
+// madvise() access pattern hints
+#define MADV_NORMAL     0  // no special treatment
+#define MADV_RANDOM     1  // random references: never read ahead
+#define MADV_SEQUENTIAL 2  // sequential references: read ahead, evict behind
+#define MADV_WILLNEED   3  // swap the range in now
+#define MADV_DONTNEED   4  // drop the range, freeing its frames and swap slots
+
+// mmap() protection bits
+#define PROT_READ       0x1  // pages may be read
+#define PROT_WRITE      0x2  // pages may be written
+
+// mmap() flags
+#define MAP_SHARED      0x01  // stores are visible to other mappers and the file
+#define MAP_PRIVATE     0x02  // stores are private to this process
+#define MAP_ANONYMOUS   0x20  // zero-filled memory, no backing file
+#define MAP_HUGE        0x40000  // back with 4MB pages where possible
+
+#define MAP_FAILED      ((void*)-1)
+
+// memstat() results, in bytes
+struct memstat {
+  uint rss;      // resident: frames mapped by the process
+  uint pss;      // proportional: each frame divided among its users
+  uint shared;   // resident frames that other processes use too
+  uint swapped;  // pages in the swap file
+};
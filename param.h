@@ -1,8 +1,7 @@
-#define NPROC        64  // maximum number of processes
+#define NPIDHASH    256  // pid hash buckets
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
@@ -11,4 +10,18 @@
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       1000  // size of file system in blocks
+#define NMADV         8  // madvise() ranges per process
+#define NVMA         24  // memory regions per process
+#define NTLBFLUSH    16  // TLB invalidations queued per process
+#define KMAXORDER    10  // largest kallocblock(): 2^10 pages, one 4MB page
+#define KCACHE       64  // free pages cached per CPU by kalloc
+#define KBATCH       32  // pages moved at once between a CPU cache and kmem
+#define SLABMAG       8  // free objects cached per CPU by each slab cache
+#define NZEROPG      64  // pre-zeroed pages kept ready by idle CPUs
+#define NMLFQ         3  // MLFQ priority levels; level i runs for 2^i ticks
+#define MLFQBOOST   100  // ticks between MLFQ priority resets
+#define NSLEEPQ      64  // wait channel hash buckets
+#define NWHEEL       64  // slots per timer wheel level, a power of 2
+#define STRIDE1   65536  // stride scheduling: a tick costs STRIDE1/tickets
+#define NTICKETS    100  // tickets of the first process
 
@@ -1,7 +1,22 @@
 // struct for keeping track of the percent of free physical pages
 struct physicalPagesCounts{
-  uint totalFreePages;
-  uint currentFreePagesNo;
+  uint totalFreePages;  // the pages free right now are counted by kfreepages()
 };
 
-extern struct physicalPagesCounts physicalPagesCounts;
\ No newline at end of file
+extern struct physicalPagesCounts physicalPagesCounts;
+
+// What the kernel knows about one frame of physical memory;
+// frames[pa / PGSIZE] describes the frame at address pa.
+struct frame {
+  pde_t *owner;      // page table that first mapped it for user space
+  uchar mapcount;    // users; a frame shared by mmap() is freed by the last kfree()
+  uchar flags;
+  ushort unused;
+  uint epoch;        // ticks when it was last seen accessed
+};
+
+#define FRAME_PINNED  0x1  // user page the pager never evicts
+#define FRAME_DIRTY   0x2  // seen written through a page table
+#define FRAME_ZEROED  0x4  // handed out filled with zeros
+
+extern struct frame *frames;
\ No newline at end of file
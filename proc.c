@@ -4,30 +4,112 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
-#include "proc.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
 #include "ppgc.h"
+#include "traps.h"
+#include "slab.h"
 
 #define SHIFT_COUNTER(x) (x >> 1);    // for shifting the counter
 #define AGE_INC 0x80000000            // adding 1 to the counter msb
 
+// Each process has a lock, p->lock, that protects its state,
+// chan, killed, pid and scheduling fields, and is held across
+// the swtch() into and out of the process. The other locks are
+// taken in this order:
+//   ptable.waitlock, ptable.lock, a sleep bucket or the timer
+//   wheel, p->lock, a run queue.
+//
+// Processes come from a slab cache and are found by pid through
+// a hash table, so their number is limited only by maxproc, which
+// is set from the size of memory at boot. A lookup takes p->lock
+// before it drops ptable.lock, and freeproc() waits for it, so a
+// process cannot be freed under a lookup.
 struct
 {
-  struct spinlock lock;
-  struct proc proc[NPROC];
+  struct spinlock lock;     // protects pidhash, nextpid and nproc
+  struct spinlock waitlock; // protects every p->parent and child
+                            // list, and keeps wait() from missing
+                            // an exit()
+  struct proc *pidhash[NPIDHASH];
+  int nproc;                // processes allocated
 } ptable;
 
+static struct slabcache proccache;
+static int maxproc;
+
+#define PIDHASH(pid) (&ptable.pidhash[(uint)(pid) % NPIDHASH])
+
+#ifdef SCHED_MLFQ
+#define NLEVEL NMLFQ
+#else
+#define NLEVEL 1    // round robin: one level
+#endif
+
+// Per-CPU queues of RUNNABLE processes, each with its own lock.
+// A process made runnable goes on the queue of the CPU it last ran
+// on, to find its cache still warm, at the level of its priority.
+// Each CPU runs its own queue, highest level first and in FIFO
+// order within a level, and when that is empty steals from the
+// other queue with the most processes that may run on it: a
+// process is only stolen by a CPU its setaffinity() mask allows.
+// Under stride scheduling a CPU runs the process
+// of lowest pass on its queue instead, and every tick it runs
+// adds STRIDE1/tickets to the pass of the process running.
+static struct runq
+{
+  struct spinlock lock;
+  struct proc *head[NLEVEL];
+  struct proc *tail[NLEVEL];
+  volatile int n;       // processes on all levels; read without the lock
+  volatile int nfor[NCPU]; // those of them that may run on each CPU
+  uint pass;            // stride: pass of the last process taken off
+} runq[NCPU];
+
+#define ALLCPUS ((1 << ncpu) - 1)
+
+// Sleeping processes, hashed by wait channel, so that wakeup()
+// only looks at processes that may sleep on its channel.
+// Each bucket is protected by its own lock.
+static struct proc *sleepq[NSLEEPQ];
+static struct spinlock sleeplock[NSLEEPQ];
+
+#define SLEEPQ(chan) (((uint)(chan) >> 2) % NSLEEPQ)
+
+// Timed sleepers, filed by expiry tick on a two-level timer wheel.
+// Level 0 holds those due within NWHEEL ticks, one slot per tick;
+// level 1 holds the rest, one slot per NWHEEL ticks, and is refiled
+// into level 0 as the wheel reaches each slot. A sleeper due more
+// than NWHEEL*NWHEEL ticks out wraps onto an earlier level 1 slot
+// and is refiled again when that slot comes round.
+// Protected by wheellock.
+static struct proc *wheel[2][NWHEEL];
+static uint wheelnow; // last tick the wheel has expired
+static struct spinlock wheellock;
+
 static struct proc *initproc;
 
 int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
 
-static void wakeup1(void *chan);
+static void makerunnable(struct proc *p);
+static void killthreads(struct proc *curproc);
+static void unsleep(struct proc *p);
 
 void pinit(void)
 {
+  int i;
+
   initlock(&ptable.lock, "ptable");
+  initlock(&ptable.waitlock, "wait");
+  slabinit(&proccache, "proc", sizeof(struct proc));
+  for (i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for (i = 0; i < NSLEEPQ; i++)
+    initlock(&sleeplock[i], "sleepq");
+  initlock(&wheellock, "wheel");
 }
 
 // Must be called with interrupts disabled
@@ -71,9 +153,58 @@ myproc(void)
   return p;
 }
 
+// Return an EMBRYO or ZOMBIE process to the slab cache.
+// p->lock must not be held, and p must be off its parent's
+// child list.
+static void
+freeproc(struct proc *p)
+{
+  struct proc **pp;
+
+  acquire(&ptable.lock);
+  for (pp = PIDHASH(p->pid); *pp != p; pp = &(*pp)->hashnext)
+    ;
+  *pp = p->hashnext;
+  ptable.nproc--;
+  release(&ptable.lock);
+
+  // wait out any lookup that found p before it left the hash
+  acquire(&p->lock);
+  release(&p->lock);
+  slabfree(&proccache, p);
+}
+
+// Return the process with the given pid, or 0 if there is none.
+// ptable.lock must be held.
+static struct proc *
+lookup(int pid)
+{
+  struct proc *p;
+
+  for (p = *PIDHASH(pid); p != 0; p = p->hashnext)
+    if (p->pid == pid)
+      break;
+  return p;
+}
+
+// Find the process with the given pid and return it with
+// p->lock held, or return 0 if there is none.
+static struct proc *
+findproc(int pid)
+{
+  struct proc *p;
+
+  acquire(&ptable.lock);
+  if ((p = lookup(pid)) != 0)
+    acquire(&p->lock);
+  release(&ptable.lock);
+  return p;
+}
+
 //PAGEBREAK: 32
-// Look in the process table for an UNUSED proc.
-// If found, change state to EMBRYO and initialize
+// Allocate a proc from the slab cache, unless there are
+// maxproc already. If found, change state to EMBRYO,
+// enter it in the pid hash and initialize
 // state required to run in the kernel.
 // Otherwise return 0.
 static struct proc *
@@ -82,25 +213,35 @@ allocproc(void)
   struct proc *p;
   char *sp;
   int i;
-  acquire(&ptable.lock);
-
-  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if (p->state == UNUSED)
-      goto found;
-
-  release(&ptable.lock);
-  return 0;
 
-found:
+  if ((p = (struct proc *)slaballoc(&proccache)) == 0)
+    return 0;
+  memset(p, 0, sizeof(*p));
+  initlock(&p->lock, "proc");
+  initsleeplock(&p->vmlock, "vm");
+  p->leader = p;
   p->state = EMBRYO;
-  p->pid = nextpid++;
+  p->affinity = ALLCPUS;
+  p->tickets = NTICKETS;
 
+  acquire(&ptable.lock);
+  if (ptable.nproc >= maxproc)
+  {
+    release(&ptable.lock);
+    slabfree(&proccache, p);
+    return 0;
+  }
+  ptable.nproc++;
+  p->pid = nextpid++;
+  p->lastcpu = cpuid();
+  p->hashnext = *PIDHASH(p->pid);
+  *PIDHASH(p->pid) = p;
   release(&ptable.lock);
 
   // Allocate kernel stack.
   if ((p->kstack = kalloc()) == 0)
   {
-    p->state = UNUSED;
+    freeproc(p);
     return 0;
   }
   sp = p->kstack + KSTACKSIZE;
@@ -144,6 +285,10 @@ found:
   p->totalPagedOut = 0;
   p->pghead = 0;
   p->pgtail = 0;
+  memset(p->madv, 0, sizeof(p->madv));
+  memset(p->vmas, 0, sizeof(p->vmas));
+  p->nvma = 0;
+  p->ntlb = 0;
   return p;
 }
 
@@ -154,6 +299,9 @@ void userinit(void)
   struct proc *p;
   extern char _binary_initcode_start[], _binary_initcode_size[];
 
+  // a process can keep MAX_PSYC_PAGES pages resident, so
+  // allow as many as would fill memory that way
+  maxproc = physicalPagesCounts.totalFreePages / MAX_PSYC_PAGES;
   p = allocproc();
 
   initproc = p;
@@ -161,6 +309,8 @@ void userinit(void)
     panic("userinit: out of memory?");
   inituvm(p->pgdir, _binary_initcode_start, (int)_binary_initcode_size);
   p->sz = PGSIZE;
+  if (initVmas(p, p->sz) < 0)
+    panic("userinit: out of regions?");
   memset(p->tf, 0, sizeof(*p->tf));
   p->tf->cs = (SEG_UCODE << 3) | DPL_USER;
   p->tf->ds = (SEG_UDATA << 3) | DPL_USER;
@@ -177,32 +327,39 @@ void userinit(void)
   // run this process. the acquire forces the above
   // writes to be visible, and the lock is also needed
   // because the assignment might not be atomic.
-  acquire(&ptable.lock);
+  acquire(&p->lock);
 
-  p->state = RUNNABLE;
+  makerunnable(p);
 
-  release(&ptable.lock);
+  release(&p->lock);
 }
 
 // Grow current process's memory by n bytes.
+// The caller must hold lockvm().
 // Return 0 on success, -1 on failure.
 int growproc(int n)
 {
   uint sz;
   struct proc *curproc = myproc();
+  struct proc *mm = curproc->leader;
 
-  sz = curproc->sz;
+  sz = mm->sz;
+  if (setBreak(mm, sz + n) < 0)
+    return -1;
   if (n > 0)
   {
-    if ((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    if ((sz = allocuvm(mm->pgdir, sz, sz + n)) == 0)
+    {
+      setBreak(mm, mm->sz);
       return -1;
+    }
   }
   else if (n < 0)
   {
-    if ((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    if ((sz = deallocuvm(mm->pgdir, sz, sz + n)) == 0)
       return -1;
   }
-  curproc->sz = sz;
+  mm->sz = sz;
   switchuvm(curproc);
   return 0;
 }
@@ -215,6 +372,7 @@ int fork(void)
   int i, pid;
   struct proc *np;
   struct proc *curproc = myproc();
+  struct proc *mm = curproc->leader;
 
   // Allocate process.
   if ((np = allocproc()) == 0)
@@ -222,20 +380,33 @@ int fork(void)
     return -1;
   }
 
+  // the address space is that of the whole thread group,
+  // held still while it is copied
+  lockvm();
+
   // Copy process state from proc.
       //  cprintf("curproc->sz = %d\n",curproc->sz);
 
-  if ((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0)
+  if ((np->pgdir = copyuvm(mm->pgdir, mm->sz)) == 0)
   {
+    unlockvm();
     kfree(np->kstack);
     np->kstack = 0;
-    np->state = UNUSED;
+    freeproc(np);
     return -1;
   }
-  np->pagesInRAM = curproc->pagesInRAM;
-  np->pagesInSwap = curproc->pagesInSwap;
-  np->sz = curproc->sz;
-  np->parent = curproc;
+  if (forkVmas(np, mm) < 0)
+  {
+    unlockvm();
+    freevm(np->pgdir);
+    kfree(np->kstack);
+    np->kstack = 0;
+    freeproc(np);
+    return -1;
+  }
+  np->pagesInRAM = mm->pagesInRAM;
+  np->pagesInSwap = mm->pagesInSwap;
+  np->sz = mm->sz;
   *np->tf = *curproc->tf;
 
   // Clear %eax so that fork returns 0 in the child.
@@ -249,8 +420,7 @@ int fork(void)
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
   pid = np->pid;
-  //paging stuff
-  createSwapFile(np); //create swap file
+  //paging stuff: the child's swap file is created on first write
   char buf[PGSIZE / 2] = "";
   int offset = 0;
   int nread = 0;
@@ -259,7 +429,7 @@ int fork(void)
   // copying swapfile data from parent
   if (curproc->pid > 2 || (strcmp(curproc->name, "init") != 0 && strcmp(curproc->name, "sh") != 0))
   {
-    while ((nread = readFromSwapFile(curproc, buf, offset, PGSIZE / 2)) != 0)
+    while ((nread = readFromSwapFile(mm, buf, offset, PGSIZE / 2)) != 0)
     {
       if (writeToSwapFile(np, buf, offset, nread) == -1)
         panic("fork: error while writing the parent's swap file to the child");
@@ -269,13 +439,16 @@ int fork(void)
   //copy arrays of pages data from parent
   for (i = 0; i < MAX_PSYC_PAGES; i++)
   {
-    np->freepages[i].va = curproc->freepages[i].va;
-    np->freepages[i].age = curproc->freepages[i].age;
-    np->swappedpages[i].age = curproc->swappedpages[i].age;
-    np->swappedpages[i].va = curproc->swappedpages[i].va;
+    np->freepages[i].va = mm->freepages[i].va;
+    np->freepages[i].age = mm->freepages[i].age;
+    np->swappedpages[i].age = mm->swappedpages[i].age;
+    np->swappedpages[i].va = mm->swappedpages[i].va;
    // cprintf("swapped i=%d , va=%x\n",i,(uint)np->swappedpages[i].va);
     //cprintf("free i=%d , va=%x\n",i,(uint)np->freepages[i].va);
   }
+  memmove(np->madv, mm->madv, sizeof(np->madv));
+  np->affinity = curproc->affinity;
+  np->tickets = curproc->tickets;
 
 
 #if defined(SCFIFO) || defined(AQ)
@@ -284,32 +457,37 @@ int fork(void)
   for (i = 0; i < MAX_PSYC_PAGES; i++)
     for (j = 0; j < MAX_PSYC_PAGES; ++j)
     {
-      if (np->freepages[j].va == curproc->freepages[i].next->va)
+      if (np->freepages[j].va == mm->freepages[i].next->va)
         np->freepages[i].next = &np->freepages[j];
-      if (np->freepages[j].va == curproc->freepages[i].prev->va)
+      if (np->freepages[j].va == mm->freepages[i].prev->va)
         np->freepages[i].prev = &np->freepages[j];
         
     }
   for (i = 0; i < MAX_PSYC_PAGES; i++)
   {
-    if (curproc->pghead->va == np->freepages[i].va)
+    if (mm->pghead->va == np->freepages[i].va)
     {
       //TODO delete       cprintf("\nfork: head copied!\n\n");
       np->pghead = &np->freepages[i];
     }
-    if (curproc->pgtail->va == np->freepages[i].va)
+    if (mm->pgtail->va == np->freepages[i].va)
     {
       np->pgtail = &np->freepages[i];
       //cprintf("\nfork: head copied!\n\n");
     }
   }
 #endif
+  unlockvm();
 
-  acquire(&ptable.lock);
-
-  np->state = RUNNABLE;
+  acquire(&ptable.waitlock);
+  np->parent = curproc;
+  np->sibling = curproc->children;
+  curproc->children = np;
+  release(&ptable.waitlock);
 
-  release(&ptable.lock);
+  acquire(&np->lock);
+  makerunnable(np);
+  release(&np->lock);
 
   return pid;
 }
@@ -317,15 +495,23 @@ int fork(void)
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
+// A leader first kills its threads and waits for them,
+// since the address space goes with it.
 void exit(void)
 {
   struct proc *curproc = myproc();
-  struct proc *p;
+  struct proc *p, *next, *heir;
   int fd;
 
   if (curproc == initproc)
     panic("init exiting");
 
+  if (curproc->leader == curproc)
+  {
+    killthreads(curproc);
+    freeVmas(curproc, curproc->pgdir);
+  }
+
   // Close all open files.
   for (fd = 0; fd < NOFILE; fd++)
   {
@@ -335,7 +521,7 @@ void exit(void)
       curproc->ofile[fd] = 0;
     }
   }
-  if (removeSwapFile(curproc) != 0)
+  if (curproc->leader == curproc && removeSwapFile(curproc) != 0)
     panic("exit: error deleting swap file");
 
   begin_op();
@@ -343,77 +529,227 @@ void exit(void)
   end_op();
   curproc->cwd = 0;
 
-  acquire(&ptable.lock);
+  acquire(&ptable.waitlock);
 
   // Parent might be sleeping in wait().
-  wakeup1(curproc->parent);
+  wakeup(curproc->parent);
 
-  // Pass abandoned children to init.
-  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+  // Pass abandoned children to init, or a thread's to its leader.
+  heir = curproc->leader == curproc ? initproc : curproc->leader;
+  if (curproc->children)
+    wakeup(heir);
+  for (p = curproc->children; p != 0; p = next)
   {
-    if (p->parent == curproc)
-    {
-      p->parent = initproc;
-      if (p->state == ZOMBIE)
-        wakeup1(initproc);
-    }
+    next = p->sibling;
+    p->parent = heir;
+    p->sibling = heir->children;
+    heir->children = p;
   }
+  curproc->children = 0;
 
-  // Jump into the scheduler, never to return.
+  // Jump into the scheduler, never to return. The parent
+  // cannot reap us before we hold our lock, and not after
+  // until the scheduler has switched away from us.
+  acquire(&curproc->lock);
   curproc->state = ZOMBIE;
+  release(&ptable.waitlock);
   sched();
   panic("zombie exit");
 }
 
+// Free an exited child of curproc and return its pid, storing
+// the stack it was given in *stack if it is a thread. Only
+// threads are looked at if thread is set, only processes if not.
+// Return 0 if no such child has exited yet, -1 if there are none.
+// ptable.waitlock must be held.
+static int
+reapchild(struct proc *curproc, int thread, uint *stack)
+{
+  struct proc *p, **pp;
+  int pid, found;
+
+  found = 0;
+  for (pp = &curproc->children; (p = *pp) != 0; pp = &p->sibling)
+  {
+    if ((p->leader != p) != thread)
+      continue;
+    found = 1;
+    acquire(&p->lock);
+    if (p->state == ZOMBIE)
+    {
+      // Found one.
+      pid = p->pid;
+      kfree(p->kstack);
+      p->kstack = 0;
+      // a thread's page table is its leader's
+      if (p->leader == p)
+        freevm(p->pgdir);
+      else
+      {
+        p->leader->nthreads--;
+        if (stack)
+          *stack = p->ustack;
+      }
+      p->pgdir = 0;
+      release(&p->lock);
+      *pp = p->sibling;
+      freeproc(p);
+      return pid;
+    }
+    release(&p->lock);
+  }
+  return found ? 0 : -1;
+}
+
+// Wait for a child process, or a thread if thread is set,
+// to exit and return its pid, as reapchild() does.
+// Return -1 if this process has no such children.
+static int
+waitchild(int thread, uint *stack)
+{
+  int pid;
+  struct proc *curproc = myproc();
+
+  acquire(&ptable.waitlock);
+  for (;;)
+  {
+    // Scan through our children looking for exited ones.
+    pid = reapchild(curproc, thread, stack);
+
+    // No point waiting if we don't have any children.
+    if (pid != 0 || curproc->killed)
+    {
+      release(&ptable.waitlock);
+      return pid > 0 ? pid : -1;
+    }
+
+    // Wait for children to exit.  (See wakeup call in exit.)
+    sleep(curproc, &ptable.waitlock); //DOC: wait-sleep
+  }
+}
+
 // Wait for a child process to exit and return its pid.
 // Return -1 if this process has no children.
 int wait(void)
+{
+  return waitchild(0, 0);
+}
+
+// Wait for a thread made by this one to exit, store the
+// stack it was given in *stack, and return its pid.
+// Return -1 if this process has no threads of its own.
+int join(uint *stack)
+{
+  int pid;
+  uint s;
+
+  // *stack is user memory, which may fault: not under waitlock
+  if ((pid = waitchild(1, &s)) > 0)
+    *stack = s;
+  return pid;
+}
+
+// Kill the threads of leader curproc and reap them, so that
+// the address space can go. They may be children of each other
+// but exit() hands any it leaves to curproc.
+static void
+killthreads(struct proc *curproc)
 {
   struct proc *p;
-  int havekids, pid;
-  struct proc *curproc = myproc();
+  int h;
 
+  acquire(&ptable.waitlock);
+  if (curproc->nthreads == 0)
+  {
+    release(&ptable.waitlock);
+    return;
+  }
+  // clone() checks killed under ptable.waitlock, so no
+  // thread is made that this misses
   acquire(&ptable.lock);
-  for (;;)
+  for (h = 0; h < NPIDHASH; h++)
   {
-    // Scan through table looking for exited children.
-    havekids = 0;
-    for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    for (p = ptable.pidhash[h]; p != 0; p = p->hashnext)
     {
-      if (p->parent != curproc)
+      if (p->leader != curproc || p == curproc)
         continue;
-      havekids = 1;
-      if (p->state == ZOMBIE)
-      {
-        // Found one.
-        pid = p->pid;
-        kfree(p->kstack);
-        p->kstack = 0;
-        freevm(p->pgdir);
-        p->pid = 0;
-        p->parent = 0;
-        p->name[0] = 0;
-        p->killed = 0;
-        p->state = UNUSED;
-        release(&ptable.lock);
-        return pid;
-      }
+      acquire(&p->lock);
+      p->killed = 1;
+      release(&p->lock);
+      unsleep(p);
     }
+  }
+  release(&ptable.lock);
+  while (curproc->nthreads > 0)
+    if (reapchild(curproc, 1, 0) <= 0)
+      sleep(curproc, &ptable.waitlock);
+  release(&ptable.waitlock);
+}
 
-    // No point waiting if we don't have any children.
-    if (!havekids || curproc->killed)
-    {
-      release(&ptable.lock);
-      return -1;
-    }
+// Create a thread that shares the address space of the current
+// process and starts at fcn(arg), on the page-sized user stack
+// at stack. fcn must not return; the thread ends with exit().
+// Returns the thread's pid, or -1.
+int clone(uint fcn, uint arg, uint stack)
+{
+  int i, pid;
+  struct proc *np;
+  struct proc *curproc = myproc();
+  uint sp;
+
+  if ((np = allocproc()) == 0)
+    return -1;
+
+  np->leader = curproc->leader;
+  np->pgdir = curproc->pgdir;
+  np->ustack = stack;
+  *np->tf = *curproc->tf;
 
-    // Wait for children to exit.  (See wakeup1 call in proc_exit.)
-    sleep(curproc, &ptable.lock); //DOC: wait-sleep
+  // a fake return PC, then the argument
+  sp = stack + PGSIZE - 2 * sizeof(uint);
+  *(uint *)sp = 0xffffffff;
+  *(uint *)(sp + sizeof(uint)) = arg;
+  np->tf->esp = sp;
+  np->tf->eip = fcn;
+
+  acquire(&ptable.waitlock);
+  // the leader may be killing its threads to exit
+  if (curproc->killed)
+  {
+    release(&ptable.waitlock);
+    kfree(np->kstack);
+    np->kstack = 0;
+    freeproc(np);
+    return -1;
   }
+  np->parent = curproc;
+  np->sibling = curproc->children;
+  curproc->children = np;
+  np->leader->nthreads++;
+  release(&ptable.waitlock);
+
+  for (i = 0; i < NOFILE; i++)
+    if (curproc->ofile[i])
+      np->ofile[i] = filedup(curproc->ofile[i]);
+  np->cwd = idup(curproc->cwd);
+
+  safestrcpy(np->name, curproc->name, sizeof(curproc->name));
+  np->affinity = curproc->affinity;
+  np->tickets = curproc->tickets;
+  pid = np->pid;
+
+  acquire(&np->lock);
+  makerunnable(np);
+  release(&np->lock);
+
+  return pid;
 }
 void aqUpdate(void){
   struct freepg *curr,*prev,*temp,*oldpgtail;
   struct proc *proc = myproc();
+  // other threads may be changing the list of a shared address space
+  if(proc->leader != proc || proc->nthreads > 0)
+    return;
   curr=proc->pghead;
   oldpgtail = proc->pgtail; // to avoid infinite loop 
   while(oldpgtail != curr){
@@ -439,12 +775,17 @@ void aqUpdate(void){
 }
 // Purpose: Iterate over all the procceses pages
 // and update the age counter
+// Holds ptable.lock and takes each p->lock in turn, so that no
+// process is reaped meanwhile.
 void updateAge(void){
   struct proc *p;
-  int i;
+  int h, i;
   pte_t *pte, *pde, *pgtab;
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+  acquire(&ptable.lock);
+  for(h = 0; h < NPIDHASH; h++)
+  for(p = ptable.pidhash[h]; p != 0; p = p->hashnext){
+    acquire(&p->lock);
     if((p->state == SLEEPING || p->state == RUNNABLE || p->state == RUNNING) && (p->pid > 2)){
       for (i = 0; i < MAX_PSYC_PAGES; i++){
         // skip not allocated pages
@@ -464,6 +805,7 @@ void updateAge(void){
           pte = 0;
         if(pte){
           // checking if the current page was access than add 1 to counter
+          frametouch(*pte);
           if( *pte & PTE_A){
              // adding 1 to the counters
             p->freepages[i].age = p->freepages[i].age | AGE_INC;
@@ -472,19 +814,249 @@ void updateAge(void){
         }
       }
     }
+    release(&p->lock);
+  }
+  release(&ptable.lock);
+}
+
+// Send a reschedule IPI to CPU c if it is halted. If c is busy,
+// send it to some other halted CPU in mask instead, so that it
+// steals the work just queued.
+// Must be called with interrupts disabled.
+static void
+kickidle(struct cpu *c, uint mask)
+{
+  struct cpu *me = mycpu();
+
+  // pairs with the xchg in scheduler(): either the idle CPU
+  // sees the queued work or we see it idle
+  __sync_synchronize();
+  if (c != me && c->idle)
+  {
+    c->idle = 0;
+    lapicipi(c->apicid, T_RESCHED);
+    return;
+  }
+  for (c = cpus; c < &cpus[ncpu]; c++)
+  {
+    if (c != me && c->idle && (mask & (1 << (c - cpus))))
+    {
+      c->idle = 0;
+      lapicipi(c->apicid, T_RESCHED);
+      return;
+    }
   }
 }
 
+// Add d to the count of processes on q that may run on each
+// CPU p may run on. q->lock must be held.
+static void
+countfor(struct runq *q, struct proc *p, int d)
+{
+  int i;
 
-void updatePages(void){
-  #ifdef AQ
-    aqUpdate();
-  #else
-  #if defined(LAPA) || defined(NFUA)
-    updateAge();
-  #endif
-  #endif
+  for (i = 0; i < ncpu; i++)
+    if (p->affinity & (1 << i))
+      q->nfor[i] += d;
 }
+
+// Mark p RUNNABLE and queue it on the CPU it last ran on, or
+// if its affinity no longer allows that, on the first CPU it does.
+// p->lock must be held.
+static void
+makerunnable(struct proc *p)
+{
+  struct runq *q;
+  int l = p->prio, kick;
+
+  if (!(p->affinity & (1 << p->lastcpu)))
+    for (p->lastcpu = 0; !(p->affinity & (1 << p->lastcpu)); p->lastcpu++)
+      ;
+  q = &runq[p->lastcpu];
+  acquire(&q->lock);
+#ifdef SCHED_STRIDE
+  // no credit for time spent asleep or not yet born
+  if ((int)(p->pass - q->pass) < 0)
+    p->pass = q->pass;
+#endif
+  p->state = RUNNABLE;
+  p->rqnext = 0;
+  if (q->tail[l])
+    q->tail[l]->rqnext = p;
+  else
+    q->head[l] = p;
+  q->tail[l] = p;
+  q->n++;
+  countfor(q, p, 1);
+  // a process yielding on its own CPU is picked up again there
+  kick = q != &runq[cpuid()] || q->n > (p == myproc());
+  release(&q->lock);
+  if (kick)
+    kickidle(&cpus[p->lastcpu], p->affinity);
+}
+
+// Unlink p, which follows prev at level l of q.
+// q->lock must be held.
+static void
+unlink(struct runq *q, int l, struct proc *prev, struct proc *p)
+{
+  if (prev)
+    prev->rqnext = p->rqnext;
+  else
+    q->head[l] = p->rqnext;
+  if (q->tail[l] == p)
+    q->tail[l] = prev;
+  q->n--;
+  countfor(q, p, -1);
+}
+
+// Take the first process that may run on CPU cpu off q, searching
+// the highest level first; under stride, the one of lowest pass.
+// Returns 0 if there is none. q->lock must be held; the fields of
+// a queued process do not change while it is queued.
+static struct proc *
+dequeue(struct runq *q, int cpu)
+{
+  struct proc *p, *prev, *best, *bestprev;
+  int l;
+
+  for (l = 0; l < NLEVEL; l++)
+  {
+    best = bestprev = 0;
+    for (prev = 0, p = q->head[l]; p != 0; prev = p, p = p->rqnext)
+    {
+      if (!(p->affinity & (1 << cpu)))
+        continue;
+#ifdef SCHED_STRIDE
+      if (best != 0 && (int)(p->pass - best->pass) >= 0)
+        continue;
+      best = p;
+      bestprev = prev;
+#else
+      best = p;
+      bestprev = prev;
+      break;
+#endif
+    }
+    if (best)
+    {
+      unlink(q, l, bestprev, best);
+      q->pass = best->pass;
+      return best;
+    }
+  }
+  return 0;
+}
+
+// Take the RUNNABLE process p off its run queue. Returns 0 if
+// it is not there, because a scheduler has just dequeued it
+// and is waiting for p->lock to run it. p->lock must be held.
+static int
+unqueue(struct proc *p)
+{
+  struct runq *q = &runq[p->lastcpu];
+  struct proc *x, *prev;
+  int l;
+
+  acquire(&q->lock);
+  for (l = 0; l < NLEVEL; l++)
+  {
+    for (prev = 0, x = q->head[l]; x != 0; prev = x, x = x->rqnext)
+    {
+      if (x == p)
+      {
+        unlink(q, l, prev, p);
+        release(&q->lock);
+        return 1;
+      }
+    }
+  }
+  release(&q->lock);
+  return 0;
+}
+
+// Charge the process running on this CPU for a timer tick,
+// whether it was spent in user space, in a system call or in
+// the page fault handler. Returns 1 if its time slice is over
+// and it should yield. Under MLFQ a process that uses up its
+// slice drops a level; under stride its pass advances.
+int quantumdone(void)
+{
+#if defined(SCHED_MLFQ) || defined(SCHED_STRIDE)
+  struct proc *p = myproc();
+#endif
+
+#ifdef SCHED_MLFQ
+  if (++p->used < (1 << p->prio))
+    return 0;
+  p->used = 0;
+  if (p->prio < NLEVEL - 1)
+    p->prio++;
+#endif
+#ifdef SCHED_STRIDE
+  p->pass += STRIDE1 / p->tickets;
+#endif
+  return 1;
+}
+
+// Move every process back to the top level, so that no process
+// starves below a stream of short-running ones.
+void boostall(void)
+{
+  struct proc *p;
+  struct runq *q;
+  int h, l;
+
+  acquire(&ptable.lock);
+  for (h = 0; h < NPIDHASH; h++)
+  {
+    for (p = ptable.pidhash[h]; p != 0; p = p->hashnext)
+    {
+      acquire(&p->lock);
+      p->prio = 0;
+      p->used = 0;
+      release(&p->lock);
+    }
+  }
+  release(&ptable.lock);
+  for (q = runq; q < &runq[ncpu]; q++)
+  {
+    acquire(&q->lock);
+    for (l = 1; l < NLEVEL; l++)
+    {
+      if (q->head[l] == 0)
+        continue;
+      if (q->tail[0])
+        q->tail[0]->rqnext = q->head[l];
+      else
+        q->head[0] = q->head[l];
+      q->tail[0] = q->tail[l];
+      q->head[l] = q->tail[l] = 0;
+    }
+    release(&q->lock);
+  }
+}
+
+// Pick the queue CPU c should run from next: its own, or the
+// other one with the most processes that may run on c. Looks at
+// the counts without the lock, so the queue may turn out empty.
+// Returns 0 if there is no work.
+static struct runq *
+pickqueue(struct cpu *c)
+{
+  struct runq *q, *busiest;
+  int cpu = c - cpus;
+
+  q = &runq[cpu];
+  if (q->n > 0)
+    return q;
+  busiest = 0;
+  for (q = runq; q < &runq[ncpu]; q++)
+    if (q->nfor[cpu] > 0 && (busiest == 0 || q->nfor[cpu] > busiest->nfor[cpu]))
+      busiest = q;
+  return busiest;
+}
+
 //PAGEBREAK: 42
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
@@ -497,6 +1069,7 @@ void scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  struct runq *q;
   c->proc = 0;
 
   for (;;)
@@ -504,35 +1077,56 @@ void scheduler(void)
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-    for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    // nothing to run: zero pages for later allocations, then
+    // halt until a timer tick or a reschedule IPI
+    if ((q = pickqueue(c)) == 0)
     {
-      if (p->state != RUNNABLE)
+      if (kzerofill())
         continue;
-
-      // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
-      // before jumping back to us.
-      c->proc = p;
-      switchuvm(p);
-      p->state = RUNNING;
-
-      swtch(&(c->scheduler), p->context);
-
-      #if defined(AQ) || defined(LAPA) || defined(NFUA)
-        updatePages();
-      #endif
-      switchkvm();
-      // Process is done running for now.
-      // It should have changed its p->state before coming back.
-      c->proc = 0;
+      cli();
+      xchg(&c->idle, 1);
+      if (pickqueue(c) == 0)
+        stihlt();
+      c->idle = 0;
+      continue;
     }
-    release(&ptable.lock);
+
+    acquire(&q->lock);
+    p = dequeue(q, c - cpus);
+    release(&q->lock);
+    if (p == 0)
+      continue;
+
+    // Switch to chosen process.  It is the process's job
+    // to release p->lock and then reacquire it
+    // before jumping back to us. Until the CPU that last
+    // ran p is done switching away from it, p->lock is
+    // still held there.
+    acquire(&p->lock);
+    c->proc = p;
+    p->lastcpu = c - cpus;
+    switchuvm(p);
+    p->state = RUNNING;
+
+    swtch(&(c->scheduler), p->context);
+
+    #ifdef AQ
+      aqUpdate();
+    #endif
+    switchkvm();
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    c->pgdir = 0;
+    release(&p->lock);
+    #if defined(LAPA) || defined(NFUA)
+      // takes every p->lock, so not while holding this one
+      updateAge();
+    #endif
   }
 }
 
-// Enter scheduler.  Must hold only ptable.lock
+// Enter scheduler.  Must hold only p->lock
 // and have changed proc->state. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
@@ -544,8 +1138,8 @@ void sched(void)
   int intena;
   struct proc *p = myproc();
 
-  if (!holding(&ptable.lock))
-    panic("sched ptable.lock");
+  if (!holding(&p->lock))
+    panic("sched p->lock");
   if (mycpu()->ncli != 1)
     panic("sched locks");
   if (p->state == RUNNING)
@@ -560,10 +1154,12 @@ void sched(void)
 // Give up the CPU for one scheduling round.
 void yield(void)
 {
-  acquire(&ptable.lock); //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  struct proc *p = myproc();
+
+  acquire(&p->lock); //DOC: yieldlock
+  makerunnable(p);
   sched();
-  release(&ptable.lock);
+  release(&p->lock);
 }
 
 // A fork child's very first scheduling by scheduler()
@@ -571,8 +1167,8 @@ void yield(void)
 void forkret(void)
 {
   static int first = 1;
-  // Still holding ptable.lock from scheduler.
-  release(&ptable.lock);
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
 
   if (first)
   {
@@ -592,6 +1188,7 @@ void forkret(void)
 void sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  int b = SLEEPQ(chan);
 
   if (p == 0)
     panic("sleep");
@@ -599,20 +1196,24 @@ void sleep(void *chan, struct spinlock *lk)
   if (lk == 0)
     panic("sleep without lk");
 
-  // Must acquire ptable.lock in order to
+  // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold ptable.lock, we can be
+  // Once we are on the bucket for chan, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup runs with ptable.lock locked),
+  // (wakeup runs with the bucket locked),
   // so it's okay to release lk.
-  if (lk != &ptable.lock)
-  {                        //DOC: sleeplock0
-    acquire(&ptable.lock); //DOC: sleeplock1
-    release(lk);
-  }
+  acquire(&sleeplock[b]); //DOC: sleeplock1
+  acquire(&p->lock);
+  release(lk);
+
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->sleepq = &sleepq[b];
+  p->sleeplock = &sleeplock[b];
+  p->sleepnext = sleepq[b];
+  sleepq[b] = p;
+  release(&sleeplock[b]);
 
   sched();
 
@@ -620,32 +1221,155 @@ void sleep(void *chan, struct spinlock *lk)
   p->chan = 0;
 
   // Reacquire original lock.
-  if (lk != &ptable.lock)
-  { //DOC: sleeplock2
-    release(&ptable.lock);
-    acquire(lk);
-  }
+  release(&p->lock); //DOC: sleeplock2
+  acquire(lk);
 }
 
 //PAGEBREAK!
 // Wake up all processes sleeping on chan.
-// The ptable lock must be held.
+void wakeup(void *chan)
+{
+  struct proc *p, **pp;
+  int b = SLEEPQ(chan);
+
+  acquire(&sleeplock[b]);
+  for (pp = &sleepq[b]; (p = *pp) != 0;)
+  {
+    if (p->chan != chan)
+    {
+      pp = &p->sleepnext;
+      continue;
+    }
+    *pp = p->sleepnext;
+    acquire(&p->lock);
+#ifdef SCHED_MLFQ
+    // waiting on the disk or for a page should not cost priority
+    if (p->faulting || p->diskwait)
+    {
+      p->prio = 0;
+      p->used = 0;
+    }
+#endif
+    makerunnable(p);
+    release(&p->lock);
+  }
+  release(&sleeplock[b]);
+}
+
+// File p on the timer wheel by its expiry tick.
+// wheellock must be held.
 static void
-wakeup1(void *chan)
+filetimer(struct proc *p)
 {
-  struct proc *p;
+  if (p->expire - wheelnow < NWHEEL)
+    p->sleepq = &wheel[0][p->expire % NWHEEL];
+  else
+    p->sleepq = &wheel[1][(p->expire / NWHEEL) % NWHEEL];
+  p->sleepnext = *p->sleepq;
+  *p->sleepq = p;
+}
+
+// Sleep until the tick count reaches expire.
+// Returns -1 if the process was killed first.
+int sleepuntil(uint expire)
+{
+  struct proc *p = myproc();
 
-  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if (p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+  acquire(&wheellock);
+  while ((int)(expire - wheelnow) > 0)
+  {
+    // kill() sets killed under p->lock, so it either
+    // shows here or finds us asleep
+    acquire(&p->lock);
+    if (p->killed)
+    {
+      release(&p->lock);
+      release(&wheellock);
+      return -1;
+    }
+    p->expire = expire;
+    p->chan = wheel;
+    p->state = SLEEPING;
+    p->sleeplock = &wheellock;
+    filetimer(p);
+    release(&wheellock);
+    sched();
+    p->chan = 0;
+    release(&p->lock);
+    acquire(&wheellock);
+  }
+  release(&wheellock);
+  return 0;
 }
 
-// Wake up all processes sleeping on chan.
-void wakeup(void *chan)
+// Advance the timer wheel to tick now, waking the sleepers
+// whose time is up. Called by the timer interrupt.
+void timertick(uint now)
 {
-  acquire(&ptable.lock);
-  wakeup1(chan);
-  release(&ptable.lock);
+  struct proc *p, *next;
+
+  acquire(&wheellock);
+  while (wheelnow != now)
+  {
+    wheelnow++;
+    if (wheelnow % NWHEEL == 0)
+    {
+      p = wheel[1][(wheelnow / NWHEEL) % NWHEEL];
+      wheel[1][(wheelnow / NWHEEL) % NWHEEL] = 0;
+      for (; p != 0; p = next)
+      {
+        next = p->sleepnext;
+        filetimer(p);
+      }
+    }
+    p = wheel[0][wheelnow % NWHEEL];
+    wheel[0][wheelnow % NWHEEL] = 0;
+    for (; p != 0; p = next)
+    {
+      next = p->sleepnext;
+      acquire(&p->lock);
+      makerunnable(p);
+      release(&p->lock);
+    }
+  }
+  release(&wheellock);
+}
+
+// Wake p if it is asleep, taking it off its sleep bucket
+// or the timer wheel. Neither lock may be held.
+static void
+unsleep(struct proc *p)
+{
+  struct spinlock *lk;
+  struct proc **pp;
+
+  for (;;)
+  {
+    acquire(&p->lock);
+    if (p->state != SLEEPING)
+    {
+      release(&p->lock);
+      return;
+    }
+    // the bucket lock comes first
+    lk = p->sleeplock;
+    release(&p->lock);
+    acquire(lk);
+    acquire(&p->lock);
+    if (p->state == SLEEPING && p->sleeplock == lk)
+    {
+      for (pp = p->sleepq; *pp != p; pp = &(*pp)->sleepnext)
+        ;
+      *pp = p->sleepnext;
+      makerunnable(p);
+      release(&p->lock);
+      release(lk);
+      return;
+    }
+    // woken meanwhile, maybe asleep again elsewhere
+    release(&p->lock);
+    release(lk);
+  }
 }
 
 // Kill the process with the given pid.
@@ -655,21 +1379,80 @@ int kill(int pid)
 {
   struct proc *p;
 
+  // ptable.lock keeps p from being freed while unsleep()
+  // has let go of p->lock
   acquire(&ptable.lock);
-  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+  if ((p = lookup(pid)) == 0)
   {
-    if (p->pid == pid)
-    {
-      p->killed = 1;
-      // Wake process from sleep if necessary.
-      if (p->state == SLEEPING)
-        p->state = RUNNABLE;
-      release(&ptable.lock);
-      return 0;
-    }
+    release(&ptable.lock);
+    return -1;
   }
+  acquire(&p->lock);
+  p->killed = 1;
+  release(&p->lock);
+  // Wake process from sleep if necessary.
+  unsleep(p);
   release(&ptable.lock);
-  return -1;
+  return 0;
+}
+
+// Restrict the process with the given pid to the CPUs in mask.
+// A queued process moves to a CPU it may use at once; a running
+// one when it next gives up its CPU, or at once if it is the caller.
+int setaffinity(int pid, uint mask)
+{
+  struct proc *p;
+  int move;
+
+  mask &= ALLCPUS;
+  if (mask == 0 || (p = findproc(pid)) == 0)
+    return -1;
+  // one just taken off its queue runs once where it is
+  if (p->state == RUNNABLE && unqueue(p))
+  {
+    p->affinity = mask;
+    makerunnable(p);
+  }
+  else
+    p->affinity = mask;
+  move = p == myproc() && !(mask & (1 << cpuid()));
+  release(&p->lock);
+  if (move)
+    yield();
+  return 0;
+}
+
+// Give the calling process n tickets: under stride scheduling,
+// its share of the CPU is proportional to them.
+int settickets(int n)
+{
+  if (n < 1 || n > STRIDE1)
+    return -1;
+  acquire(&myproc()->lock);
+  myproc()->tickets = n;
+  release(&myproc()->lock);
+  return 0;
+}
+
+// Report the memory use of the process with the given pid in *ms.
+// The page table is walked under p->lock: its pages are only freed
+// by reaping, which holds p->lock, and by exec(), which swaps
+// p->pgdir under p->lock first. sbrk() and munmap() may still
+// change entries meanwhile, so the figures are a snapshot.
+int memstat(int pid, struct memstat *ms)
+{
+  struct proc *p;
+
+  if ((p = findproc(pid)) == 0)
+    return -1;
+  if (p->pgdir == 0)
+  {
+    release(&p->lock);
+    return -1;
+  }
+  memusage(p->pgdir, ms);
+  release(&p->lock);
+  return 0;
 }
 
 //PAGEBREAK: 36
@@ -685,15 +1468,14 @@ void procdump(void)
       [RUNNABLE] "runble",
       [RUNNING] "run   ",
       [ZOMBIE] "zombie"};
-  int i;
+  int h, i;
   struct proc *p;
   char *state;
   uint pc[10];
 
-  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+  for (h = 0; h < NPIDHASH; h++)
+  for (p = ptable.pidhash[h]; p != 0; p = p->hashnext)
   {
-    if (p->state == UNUSED)
-      continue;
     if (p->state >= 0 && p->state < NELEM(states) && states[p->state])
       state = states[p->state];
     else
@@ -715,7 +1497,8 @@ void procdump(void)
     cprintf("\n");
   }
     #ifdef VERBOSE_PRINT
-    cprintf("\n %d / %d free pages in the system\n",  physicalPagesCounts.currentFreePagesNo,physicalPagesCounts.totalFreePages );
+    cprintf("\n %d / %d free pages in the system\n",  kfreepages(),physicalPagesCounts.totalFreePages );
+    kallocdump();
     #endif
 }
 
@@ -11,6 +11,8 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  pde_t *pgdir;                // User page table loaded in %cr3, or null
+  volatile uint idle;          // Halted in scheduler(), waiting for work
 };
 
 extern struct cpu cpus[NCPU];
@@ -51,8 +53,39 @@ struct freepg {
   struct freepg *prev;
 };
 
+// madvise() hint covering user addresses [start, end)
+struct madvrange {
+  uint start;
+  uint end;
+  int advice;
+};
+
+// Kinds of virtual memory area
+#define VMA_TEXT  1  // read-only part of the executable
+#define VMA_DATA  2  // writable part of the executable, and its bss
+#define VMA_STACK 3  // fixed-size user stack
+#define VMA_HEAP  4  // grown and shrunk by sbrk()
+#define VMA_MMAP  5  // set up by mmap()
+
+// A region of user memory [start, end), page aligned.
+// Pages of a region that are not mapped are filled in on
+// demand from its backing: the executable or mapped file
+// for the first filesz bytes, zeros after that.
+struct vma {
+  uint start;
+  uint end;
+  int kind;                    // VMA_ kind
+  int prot;                    // PROT_ bits
+  int flags;                   // MAP_ flags, for VMA_MMAP
+  struct file *f;              // mmap()ed file, or 0
+  struct inode *ip;            // Executable, for VMA_TEXT and VMA_DATA, or 0
+  uint off;                    // Offset of start in f or ip
+  uint filesz;                 // Bytes of the region backed by f or ip
+};
+
 // Per-process state
 struct proc {
+  struct spinlock lock;        // Protects state, chan, killed, pid and scheduling
   uint sz;                     // Size of process memory (bytes)
   pde_t* pgdir;                // Page table
   char *kstack;                // Bottom of kernel stack for this process
@@ -78,10 +111,45 @@ struct proc {
   struct pgdesc swappedpages[MAX_PSYC_PAGES]; // Pre-allocated space for the pages in swap file array
   struct freepg *pghead;                      // Head of the pages in physical memory linked list
   struct freepg *pgtail;                      // End of the pages in physical memory linked list
+  struct madvrange madv[NMADV];               // Access pattern hints set by madvise()
+  struct vma vmas[NVMA];                      // Memory regions, sorted by address
+  int nvma;                                   // No. of entries used in vmas
+  uint tlbva[NTLBFLUSH];                      // Pages other CPUs must still invalidate
+  char *tlbfree[NTLBFLUSH];                   // Frames to free once they have
+  int ntlb;                                   // No. of queued invalidations
+  struct proc *rqnext;                        // Next on the same run queue
+  struct proc *sleepnext;                     // Next sleeping in the same bucket
+  struct proc **sleepq;                       // Bucket holding this process while asleep
+  struct spinlock *sleeplock;                 // Lock of that bucket
+  uint expire;                                // Tick at which a timed sleep ends
+  int prio;                                   // MLFQ level, 0 runs first
+  int used;                                   // Ticks run at this level
+  int faulting;                               // In the page fault handler
+  int ilocks;                                 // Inodes it holds locked
+  int diskwait;                               // Waiting for the disk in iderw()
+  int lastcpu;                                // CPU it last ran or was queued on
+  uint affinity;                              // Mask of CPUs it may run on
+  int tickets;                                // Share of the CPU under stride scheduling
+  struct proc *hashnext;                      // Next in the same pid hash bucket
+  struct proc *children;                      // First child
+  struct proc *sibling;                       // Next child of the same parent
+  uint pass;                                  // Stride: virtual time used, lowest runs first
+  struct proc *leader;                        // Owner of the address space: itself, or for a
+                                              // thread the process it belongs to
+  int nthreads;                               // Threads sharing this leader's address space
+  uint ustack;                                // Stack given to clone(), returned by join()
+  struct sleeplock vmlock;                    // Held across changes to the address space
 };
 
-// Process memory is laid out contiguously, low addresses first:
+// Threads made by clone() share their leader's sz, pgdir, regions,
+// paging lists and swap file, and the leader's vmlock serializes
+// page faults and other changes to them. Those fields of a thread
+// itself are unused, but for pgdir, which is the leader's.
+
+// Process memory is laid out as regions, low addresses first:
 //   text
 //   original data and bss
+//   unmapped guard page
 //   fixed-size stack
-//   expandable heap
+//   expandable heap, ending at sz
+//   mmap() regions, from MMAPBASE
@@ -0,0 +1,169 @@
+// Slab allocator, for kernel objects much smaller than a page.
+//
+// A slab is a kalloc() page holding a struct slab followed by
+// objects of one size. The slabs of a cache that have free
+// objects are on its partial list; a slab whose objects are all
+// free goes back to kalloc().
+//
+// Each CPU keeps a magazine of up to SLABMAG free objects per
+// cache, used with interrupts off. slaballoc() and slabfree()
+// only take the cache lock to move half a magazine between it
+// and the slabs.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "slab.h"
+
+struct slabobj {
+  struct slabobj *next;
+};
+
+struct slab {
+  struct slab *next;    // on the partial list
+  struct slab *prev;
+  struct slabobj *free; // free objects in this slab
+  int inuse;            // objects handed out or in a magazine
+};
+
+void
+slabinit(struct slabcache *c, char *name, uint size)
+{
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = (size + sizeof(struct slabobj) - 1) & ~(sizeof(struct slabobj) - 1);
+  c->perslab = (PGSIZE - sizeof(struct slab)) / c->size;
+  if(c->perslab == 0)
+    panic("slabinit");
+  c->partial = 0;
+  c->nslab = 0;
+}
+
+static void
+unlinkslab(struct slabcache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+static void
+linkslab(struct slabcache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+// Put a fresh slab on c's partial list. Caller holds c->lock.
+static int
+growcache(struct slabcache *c)
+{
+  struct slab *s;
+  struct slabobj *o;
+  uint i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return -1;
+  s->free = 0;
+  s->inuse = 0;
+  for(i = 0; i < c->perslab; i++){
+    o = (struct slabobj*)((char*)(s + 1) + i * c->size);
+    o->next = s->free;
+    s->free = o;
+  }
+  linkslab(c, s);
+  c->nslab++;
+  return 0;
+}
+
+// Fill the magazine of cpu half way from the slabs of c.
+static void
+refillmag(struct slabcache *c, int cpu)
+{
+  struct slab *s;
+  struct slabobj *o;
+
+  acquire(&c->lock);
+  while(c->mag[cpu].n < SLABMAG/2){
+    if(c->partial == 0 && growcache(c) < 0)
+      break;
+    s = c->partial;
+    o = s->free;
+    s->free = o->next;
+    s->inuse++;
+    if(s->free == 0)
+      unlinkslab(c, s);
+    c->mag[cpu].obj[c->mag[cpu].n++] = o;
+  }
+  release(&c->lock);
+}
+
+// Return half of the full magazine of cpu to the slabs of c.
+static void
+drainmag(struct slabcache *c, int cpu)
+{
+  struct slab *s;
+  struct slabobj *o;
+
+  acquire(&c->lock);
+  while(c->mag[cpu].n > SLABMAG/2){
+    o = c->mag[cpu].obj[--c->mag[cpu].n];
+    s = (struct slab*)PGROUNDDOWN((uint)o);
+    if(s->free == 0)
+      linkslab(c, s);
+    o->next = s->free;
+    s->free = o;
+    if(--s->inuse == 0){
+      unlinkslab(c, s);
+      c->nslab--;
+      kfree((char*)s);
+    }
+  }
+  release(&c->lock);
+}
+
+// Allocate an object from cache c.
+// Returns 0 if the memory cannot be allocated.
+void*
+slaballoc(struct slabcache *c)
+{
+  void *p;
+  int cpu;
+
+  pushcli();
+  cpu = cpuid();
+  if(c->mag[cpu].n == 0)
+    refillmag(c, cpu);
+  p = 0;
+  if(c->mag[cpu].n > 0)
+    p = c->mag[cpu].obj[--c->mag[cpu].n];
+  popcli();
+  return p;
+}
+
+// Free object p, which slaballoc(c) returned.
+void
+slabfree(struct slabcache *c, void *p)
+{
+  int cpu;
+
+#ifdef JUNK_FILL
+  // Fill with junk to catch dangling refs.
+  memset(p, 1, c->size);
+#endif
+
+  pushcli();
+  cpu = cpuid();
+  if(c->mag[cpu].n == SLABMAG)
+    drainmag(c, cpu);
+  c->mag[cpu].obj[c->mag[cpu].n++] = p;
+  popcli();
+}
@@ -0,0 +1,13 @@
+// Cache of fixed-size kernel objects, carved out of kalloc() pages.
+struct slabcache {
+  struct spinlock lock;
+  char *name;          // Name of cache, for debugging.
+  uint size;           // Bytes per object
+  uint perslab;        // Objects per page
+  struct slab *partial; // Pages with free objects
+  uint nslab;          // Pages in use by the cache
+  struct {
+    int n;
+    void *obj[SLABMAG];
+  } mag[NCPU];         // Free objects cached by each CPU
+};
@@ -6,9 +6,9 @@
 #include "x86.h"
 #include "memlayout.h"
 #include "mmu.h"
-#include "proc.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "proc.h"
 
 void
 initsleeplock(struct sleeplock *lk, char *name)
@@ -41,13 +41,14 @@ releasesleep(struct sleeplock *lk)
   release(&lk->lk);
 }
 
+// Is the lock held by this process?
 int
 holdingsleep(struct sleeplock *lk)
 {
   int r;
   
   acquire(&lk->lk);
-  r = lk->locked;
+  r = lk->locked && (lk->pid == myproc()->pid);
   release(&lk->lk);
   return r;
 }
@@ -3,6 +3,8 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "x86.h"
 #include "syscall.h"
@@ -19,7 +21,7 @@ fetchint(uint addr, int *ip)
 {
   struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz || addr+4 > curproc->sz)
+  if(addr+4 < addr || addr+4 > vmaEnd(curproc->leader, addr))
     return -1;
   *ip = *(int*)(addr);
   return 0;
@@ -34,10 +36,9 @@ fetchstr(uint addr, char **pp)
   char *s, *ep;
   struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz)
+  if((ep = (char*)vmaEnd(curproc->leader, addr)) == 0)
     return -1;
   *pp = (char*)addr;
-  ep = (char*)curproc->sz;
   for(s = *pp; s < ep; s++){
     if(*s == 0)
       return s - *pp;
@@ -63,7 +64,7 @@ argptr(int n, char **pp, int size)
  
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  if(size < 0 || (uint)i+size < (uint)i || (uint)i+size > vmaEnd(curproc->leader, i))
     return -1;
   *pp = (char*)i;
   return 0;
@@ -71,8 +72,8 @@ argptr(int n, char **pp, int size)
 
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
-// (There is no shared writable memory, so the string can't change
-// between this check and being used by the kernel.)
+// (Another thread sharing the memory can still change the string
+// between this check and its use by the kernel.)
 int
 argstr(int n, char **pp)
 {
@@ -104,6 +105,16 @@ extern int sys_wait(void);
 extern int sys_write(void);
 extern int sys_uptime(void);
 extern int sys_yield(void);
+extern int sys_madvise(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_memstat(void);
+extern int sys_mempressure(void);
+extern int sys_setaffinity(void);
+extern int sys_settickets(void);
+extern int sys_clone(void);
+extern int sys_join(void);
+extern int sys_getcpu(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -128,6 +139,16 @@ static int (*syscalls[])(void) = {
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
 [SYS_yield]   sys_yield,
+[SYS_madvise] sys_madvise,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_memstat] sys_memstat,
+[SYS_mempressure] sys_mempressure,
+[SYS_setaffinity] sys_setaffinity,
+[SYS_settickets] sys_settickets,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
+[SYS_getcpu]  sys_getcpu,
 };
 
 void
@@ -21,3 +21,13 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_yield  22
+#define SYS_madvise 23
+#define SYS_mmap   24
+#define SYS_munmap 25
+#define SYS_memstat 26
+#define SYS_mempressure 27
+#define SYS_setaffinity 28
+#define SYS_settickets 29
+#define SYS_clone  30
+#define SYS_join   31
+#define SYS_getcpu 32
@@ -5,7 +5,11 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
+#include "mman.h"
+#include "ppgc.h"
 
 
 int sys_yield(void)
@@ -57,34 +61,156 @@ sys_sbrk(void)
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
   if(n == -1){
     return -1;
   }
+  lockvm();
+  addr = myproc()->leader->sz;
   if(growproc(n) < 0)
-    return -1;
+    addr = -1;
+  unlockvm();
   return addr;
 }
 
 int
-sys_sleep(void)
+sys_madvise(void)
+{
+  int addr, len, advice, r;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &advice) < 0)
+    return -1;
+  lockvm();
+  r = madvise((uint)addr, (uint)len, advice);
+  unlockvm();
+  return r;
+}
+
+int
+sys_munmap(void)
+{
+  int addr, len, r;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0)
+    return -1;
+  lockvm();
+  r = munmap((uint)addr, (uint)len);
+  unlockvm();
+  return r;
+}
+
+int
+sys_memstat(void)
+{
+  int pid;
+  struct memstat *ms, st;
+
+  if(argint(0, &pid) < 0 || argptr(1, (void*)&ms, sizeof(*ms)) < 0)
+    return -1;
+  if(memstat(pid, &st) < 0)
+    return -1;
+  *ms = st;
+  return 0;
+}
+
+// Wait until fewer than n pages of memory are free, and return
+// how many are. With n <= 0, return at once the percentage of
+// memory in use.
+int
+sys_mempressure(void)
 {
   int n;
-  uint ticks0;
+  uint nfree;
 
   if(argint(0, &n) < 0)
     return -1;
+  if(n <= 0)
+    return 100 - kfreepages() * 100 / physicalPagesCounts.totalFreePages;
   acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
+  while((nfree = kfreepages()) >= n){
     if(myproc()->killed){
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    // the timer interrupt checks the highest threshold
+    if(pressuremax < n)
+      pressuremax = n;
+    sleep(&pressuremax, &tickslock);
   }
   release(&tickslock);
-  return 0;
+  return nfree;
+}
+
+// Pin process pid to the CPUs whose bits are set in mask.
+int
+sys_setaffinity(void)
+{
+  int pid, mask;
+
+  if(argint(0, &pid) < 0 || argint(1, &mask) < 0)
+    return -1;
+  return setaffinity(pid, (uint)mask);
+}
+
+// The CPU the caller runs on. Unless the caller is pinned
+// to it, that may change as soon as this returns.
+int
+sys_getcpu(void)
+{
+  int c;
+
+  pushcli();
+  c = cpuid();
+  popcli();
+  return c;
+}
+
+int
+sys_settickets(void)
+{
+  int n;
+
+  if(argint(0, &n) < 0)
+    return -1;
+  return settickets(n);
+}
+
+// Start a thread at fcn(arg) on a one-page stack,
+// sharing this process's memory.
+int
+sys_clone(void)
+{
+  int fcn, arg;
+  char *stack;
+
+  if(argint(0, &fcn) < 0 || argint(1, &arg) < 0 ||
+     argptr(2, &stack, PGSIZE) < 0)
+    return -1;
+  return clone((uint)fcn, (uint)arg, (uint)stack);
+}
+
+// Wait for a thread to exit and hand back its stack.
+int
+sys_join(void)
+{
+  char *stack;
+
+  if(argptr(0, &stack, sizeof(void*)) < 0)
+    return -1;
+  return join((uint*)stack);
+}
+
+int
+sys_sleep(void)
+{
+  int n;
+  uint ticks0;
+
+  if(argint(0, &n) < 0)
+    return -1;
+  acquire(&tickslock);
+  ticks0 = ticks;
+  release(&tickslock);
+  return sleepuntil(ticks0 + n);
 }
 
 // return how many clock tick interrupts have occurred
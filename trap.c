@@ -3,16 +3,18 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "x86.h"
 #include "traps.h"
-#include "spinlock.h"
 
 // Interrupt descriptor table (shared by all CPUs).
 struct gatedesc idt[256];
 extern uint vectors[]; // in vectors.S: array of 256 entry pointers
 struct spinlock tickslock;
 uint ticks;
+uint pressuremax;  // highest free page threshold waited for in mempressure()
 
 void tvinit(void)
 {
@@ -33,8 +35,8 @@ void idtinit(void)
 //PAGEBREAK: 41
 void trap(struct trapframe *tf)
 {
-   uint addr;
-  pde_t *vaddr;
+  int r;
+
   if (tf->trapno == T_SYSCALL)
   {
     if (myproc()->killed)
@@ -53,8 +55,16 @@ void trap(struct trapframe *tf)
     {
       acquire(&tickslock);
       ticks++;
-      wakeup(&ticks);
+      timertick(ticks);
+      if(pressuremax && kfreepages() < pressuremax){
+        pressuremax = 0;
+        wakeup(&pressuremax);
+      }
       release(&tickslock);
+#ifdef SCHED_MLFQ
+      if(ticks % MLFQBOOST == 0)
+        boostall();
+#endif
     }
     lapiceoi();
     break;
@@ -73,6 +83,14 @@ void trap(struct trapframe *tf)
     uartintr();
     lapiceoi();
     break;
+  case T_TLBFLUSH:
+    tlbintr();
+    lapiceoi();
+    break;
+  case T_RESCHED:
+    // scheduler() looks at the run queues again once hlt returns
+    lapiceoi();
+    break;
   case T_IRQ0 + 7:
   case T_IRQ0 + IRQ_SPURIOUS:
     cprintf("cpu%d: spurious interrupt at %x:%x\n",
@@ -80,17 +98,25 @@ void trap(struct trapframe *tf)
     lapiceoi();
     break;
   case T_PGFLT://page fault handling
-    addr = rcr2();
-    vaddr = &myproc()->pgdir[PDX(addr)];
-
-    // cprintf("PGFLT --- addr:0x%x vaddr:0x%x PDX:0x%x PTX:0x%x FLAGS:0x%x\n", addr, vaddr, PDX(*vaddr),PTX(*vaddr),PTE_FLAGS(*vaddr)); //TODO delete
-    // cprintf("&PTE_PG:%x &PTE_P:%x  &PTE_P:%x\n", (((uint*)PTE_ADDR(P2V(*vaddr)))[PTX(addr)] & PTE_PG), ((((uint*)PTE_ADDR(P2V(*vaddr)))[PTX(addr)] & PTE_P)),((int)(*vaddr) & PTE_P)); //TODO delete
-    if (((int)(*vaddr) & PTE_P) != 0)
-    { // if page table isn't present at page directory -> hard page fault
-      if (((uint *)PTE_ADDR(P2V(*vaddr)))[PTX(addr)] & PTE_PG)
-      { // if the page is in the process's swap file
-        // cprintf("page is in swap file, pid %d, va %p\n", proc->pid, addr); //TODO delete
-        handlePageFault(PTE_ADDR(addr));//handle swap pages by SELECTION
+    // the handler sleeps on vmlock and the swap file, so kernel
+    // code must not touch user memory while holding a spinlock;
+    // such a fault falls through to the panic below. The handler
+    // itself only touches kernel memory, so faults do not nest,
+    // and it may lock a mapped file's inode, which vmlock comes
+    // before, so no inode may be held locked at the fault.
+    if (myproc() != 0 && mycpu()->ncli == 0)
+    {
+      if (myproc()->faulting)
+        panic("nested page fault");
+      if (myproc()->ilocks)
+        panic("page fault holding an inode");
+      myproc()->faulting = 1;
+      lockvm();
+      r = handlePageFault(rcr2());
+      unlockvm();
+      myproc()->faulting = 0;
+      if (r == 0)
+      { // swapped in, or refilled after madvise(MADV_DONTNEED)
         ++myproc()->totalPageFaults;
         return;
       }
@@ -122,7 +148,7 @@ void trap(struct trapframe *tf)
   // Force process to give up CPU on clock tick.
   // If interrupts were on while locks held, would need to check nlock.
   if (myproc() && myproc()->state == RUNNING &&
-      tf->trapno == T_IRQ0 + IRQ_TIMER)
+      tf->trapno == T_IRQ0 + IRQ_TIMER && quantumdone())
     yield();
 
   // Check if the process has been killed since we yielded
@@ -1,4 +1,5 @@
 struct stat;
+struct memstat;
 struct rtcdate;
 
 // system calls
@@ -24,6 +25,16 @@ char* sbrk(int);
 int sleep(int);
 int uptime(void);
 int yield(void);
+int madvise(void*, int, int);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int memstat(int, struct memstat*);
+int mempressure(int);
+int setaffinity(int, uint);
+int settickets(int);
+int clone(void(*)(void*), void*, void*);
+int join(void**);
+int getcpu(void);
 
 // ulib.c
 int stat(char*, struct stat*);
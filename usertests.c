@@ -7,6 +7,7 @@
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
+#include "mman.h"
 
 char buf[8192];
 char name[3];
@@ -1374,7 +1375,7 @@ iref(void)
 }
 
 // test that fork fails gracefully
-// the forktest binary also does this, but it runs out of proc entries first.
+// the forktest binary also does this, but it runs into the process limit first.
 // inside the bigger usertests binary, we run out of memory first.
 void
 forktest(void)
@@ -1383,7 +1384,7 @@ forktest(void)
 
   printf(1, "fork test\n");
 
-  for(n=0; n<1000; n++){
+  for(n=0; n<10000; n++){
     pid = fork();
     if(pid < 0)
       break;
@@ -1391,8 +1392,8 @@ forktest(void)
       exit();
   }
 
-  if(n == 1000){
-    printf(1, "fork claimed to work 1000 times!\n");
+  if(n == 10000){
+    printf(1, "fork claimed to work 10000 times!\n");
     exit();
   }
 
@@ -1559,6 +1560,620 @@ validateint(int *p)
       "ebx");
 }
 
+// madvise() hints: dropped pages read back as zeros, the
+// sequential and prefetch hints keep the data intact.
+void
+madvisetest(void)
+{
+  char *a;
+  int i, n;
+
+  printf(stdout, "madvise test\n");
+  n = 8;
+  a = sbrk((n+1)*4096);
+  a = (char*)(((uint)a + 4095) & ~4095);
+  for(i = 0; i < n*4096; i += 4096)
+    a[i] = i / 4096 + 1;
+
+  if(madvise(a, n*4096, MADV_SEQUENTIAL) < 0){
+    printf(stdout, "madvise sequential failed\n");
+    exit();
+  }
+  for(i = 0; i < n*4096; i += 4096){
+    if(a[i] != i / 4096 + 1){
+      printf(stdout, "madvise sequential scan read wrong data\n");
+      exit();
+    }
+  }
+  if(madvise(a, n*4096, MADV_WILLNEED) < 0 || a[0] != 1){
+    printf(stdout, "madvise willneed failed\n");
+    exit();
+  }
+  if(madvise(a + 4096, 2*4096, MADV_DONTNEED) < 0){
+    printf(stdout, "madvise dontneed failed\n");
+    exit();
+  }
+  if(a[4096] != 0 || a[2*4096] != 0 || a[3*4096] != 4){
+    printf(stdout, "madvise dontneed did not zero the range\n");
+    exit();
+  }
+  if(madvise(a + 1, 4096, MADV_NORMAL) >= 0 ||
+     madvise(a, 4096, 99) >= 0 ||
+     madvise(sbrk(0), 4096, MADV_NORMAL) >= 0){
+    printf(stdout, "madvise accepted bad arguments\n");
+    exit();
+  }
+  madvise(a, n*4096, MADV_NORMAL);
+  sbrk(-(n+1)*4096);
+  printf(stdout, "madvise test ok\n");
+}
+
+void
+mmaptest(void)
+{
+  char *a, *b, buf[16];
+  int fd, i, n, pid;
+
+  printf(stdout, "mmap test\n");
+  n = 4;
+
+  // anonymous private memory starts out zero and survives fork
+  a = mmap(0, n*4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(a == MAP_FAILED){
+    printf(stdout, "mmap anonymous failed\n");
+    exit();
+  }
+  for(i = 0; i < n*4096; i += 4096){
+    if(a[i] != 0){
+      printf(stdout, "mmap anonymous page not zero\n");
+      exit();
+    }
+    a[i] = i / 4096 + 1;
+  }
+  pid = fork();
+  if(pid == 0){
+    a[0] = 99;
+    exit();
+  }
+  wait();
+  if(a[0] != 1 || a[3*4096] != 4){
+    printf(stdout, "mmap private page changed by child\n");
+    exit();
+  }
+  if(munmap(a, n*4096) < 0){
+    printf(stdout, "munmap anonymous failed\n");
+    exit();
+  }
+
+  // anonymous shared memory is seen by the parent
+  a = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(a == MAP_FAILED){
+    printf(stdout, "mmap shared anonymous failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid == 0){
+    a[10] = 'x';
+    exit();
+  }
+  wait();
+  if(a[10] != 'x'){
+    printf(stdout, "mmap shared store lost\n");
+    exit();
+  }
+  munmap(a, 4096);
+
+  // file backed mappings: private reads, shared stores reach the file
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  for(i = 0; i < 2*4096; i += sizeof(buf)){
+    for(n = 0; n < sizeof(buf); n++)
+      buf[n] = 'a' + (i + n) % 26;
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf(stdout, "mmap write file failed\n");
+      exit();
+    }
+  }
+  a = mmap(0, 2*4096, PROT_READ, MAP_PRIVATE, fd, 0);
+  b = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 4096);
+  if(a == MAP_FAILED || b == MAP_FAILED || a == b){
+    printf(stdout, "mmap file failed\n");
+    exit();
+  }
+  if(a[0] != 'a' || a[4096+1] != 'a' + (4096+1) % 26 || b[0] != a[4096]){
+    printf(stdout, "mmap file read wrong data\n");
+    exit();
+  }
+  b[0] = 'Z';
+  if(munmap(b, 4096) < 0 || munmap(a, 2*4096) < 0){
+    printf(stdout, "munmap file failed\n");
+    exit();
+  }
+  close(fd);
+  fd = open("mmapfile", 0);
+  for(i = 0; i < 4096; i += sizeof(buf))
+    read(fd, buf, sizeof(buf));
+  if(read(fd, buf, 1) != 1 || buf[0] != 'Z'){
+    printf(stdout, "mmap shared store not written back\n");
+    exit();
+  }
+  close(fd);
+
+  // read() and write() of a file through a page of its own mapping
+  // not yet faulted in: the fault reads the file while they hold it
+  fd = open("mmapfile", O_RDWR);
+  a = mmap(0, 2*4096, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(a == MAP_FAILED){
+    printf(stdout, "mmap file failed\n");
+    exit();
+  }
+  if(read(fd, a, 4096) != 4096 || a[1] != 'b' || a[4095] != 'a' + 4095 % 26){
+    printf(stdout, "read into own mapping failed\n");
+    exit();
+  }
+  if(write(fd, a + 4096, 16) != 16){
+    printf(stdout, "write from own mapping failed\n");
+    exit();
+  }
+  munmap(a, 2*4096);
+  close(fd);
+  unlink("mmapfile");
+
+  // two processes each read() one file into an unfaulted mapping
+  // of the other: the faults must not lock one file while the
+  // read() holds the other
+  for(n = 0; n < 2; n++){
+    fd = open(n ? "mmapfb" : "mmapfa", O_CREATE|O_RDWR);
+    for(i = 0; i < 4*4096; i += sizeof(buf)){
+      memset(buf, n ? 'b' : 'a', sizeof(buf));
+      write(fd, buf, sizeof(buf));
+    }
+    close(fd);
+  }
+  pid = fork();
+  n = pid == 0;
+  for(i = 0; i < 20; i++){
+    fd = open(n ? "mmapfa" : "mmapfb", O_RDWR);
+    a = mmap(0, 4*4096, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    fd = open(n ? "mmapfb" : "mmapfa", 0);
+    if(a == MAP_FAILED || read(fd, a, 4*4096) != 4*4096 ||
+       a[4*4096 - 1] != (n ? 'b' : 'a')){
+      printf(stdout, "read across mapped files failed\n");
+      exit();
+    }
+    close(fd);
+    munmap(a, 4*4096);
+  }
+  if(pid == 0)
+    exit();
+  wait();
+  unlink("mmapfa");
+  unlink("mmapfb");
+
+  if(mmap(0, 0, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0) != MAP_FAILED ||
+     mmap(0, 4096, PROT_READ, MAP_PRIVATE, 99, 0) != MAP_FAILED ||
+     mmap(0, 4096, PROT_READ, MAP_SHARED|MAP_PRIVATE|MAP_ANONYMOUS, -1, 0) != MAP_FAILED ||
+     mmap(0, 1024*4096, PROT_READ, MAP_SHARED|MAP_ANONYMOUS, -1, 0) != MAP_FAILED ||
+     munmap((char*)1, 4096) >= 0){
+    printf(stdout, "mmap accepted bad arguments\n");
+    exit();
+  }
+  printf(stdout, "mmap test ok\n");
+}
+
+// MAP_HUGE regions: 4MB pages that survive fork and partial munmap
+void
+hugetest(void)
+{
+  char *a;
+  int pid;
+
+  printf(stdout, "huge page test\n");
+  a = mmap(0, 8*1024*1024, PROT_READ|PROT_WRITE,
+           MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGE, -1, 0);
+  if(a == MAP_FAILED || (uint)a % (4*1024*1024) != 0){
+    printf(stdout, "mmap huge failed\n");
+    exit();
+  }
+  a[0] = 1;
+  a[4096] = 2;
+  a[4*1024*1024 - 1] = 3;
+  a[8*1024*1024 - 1] = 4;
+  pid = fork();
+  if(pid == 0){
+    if(a[0] != 1 || a[8*1024*1024 - 1] != 4){
+      printf(stdout, "huge page not copied to child\n");
+      exit();
+    }
+    a[0] = 99;
+    exit();
+  }
+  wait();
+  if(a[0] != 1){
+    printf(stdout, "huge page changed by child\n");
+    exit();
+  }
+  // unmapping one page splits its large page
+  if(munmap(a + 4096, 4096) < 0){
+    printf(stdout, "munmap in huge page failed\n");
+    exit();
+  }
+  if(a[0] != 1 || a[4*1024*1024 - 1] != 3 || a[8*1024*1024 - 1] != 4){
+    printf(stdout, "huge page lost data on split\n");
+    exit();
+  }
+  if(munmap(a, 8*1024*1024) < 0){
+    printf(stdout, "munmap huge failed\n");
+    exit();
+  }
+  printf(stdout, "huge page test ok\n");
+}
+
+// memstat() sees pages shared with a child at half their size
+void
+memstattest(void)
+{
+  struct memstat before, after;
+  char *a;
+  int fds[2], pid;
+
+  printf(stdout, "memstat test\n");
+  if(memstat(getpid(), &before) < 0 || before.rss == 0 ||
+     before.pss > before.rss || memstat(-1, &before) >= 0){
+    printf(stdout, "memstat failed\n");
+    exit();
+  }
+  a = mmap(0, 2*4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(a == MAP_FAILED || pipe(fds) < 0){
+    printf(stdout, "memstat setup failed\n");
+    exit();
+  }
+  a[0] = a[4096] = 1;
+  pid = fork();
+  if(pid == 0){
+    read(fds[0], &pid, 1);
+    exit();
+  }
+  if(memstat(getpid(), &after) < 0 || after.shared < 2*4096 ||
+     after.pss >= after.rss){
+    printf(stdout, "memstat missed shared pages\n");
+    exit();
+  }
+  write(fds[1], "x", 1);
+  wait();
+  close(fds[0]);
+  close(fds[1]);
+  munmap(a, 2*4096);
+  printf(stdout, "memstat test ok\n");
+}
+
+// mempressure() reports the level, and returns at once when
+// free memory is already below the threshold
+void
+mempressuretest(void)
+{
+  int n;
+
+  printf(stdout, "mempressure test\n");
+  n = mempressure(0);
+  if(n < 0 || n > 100){
+    printf(stdout, "mempressure level %d out of range\n", n);
+    exit();
+  }
+  if(mempressure(0x7fffffff) <= 0){
+    printf(stdout, "mempressure did not report free pages\n");
+    exit();
+  }
+  printf(stdout, "mempressure test ok\n");
+}
+
+// sleepers due at different ticks, on both levels of the timer
+// wheel, each wake no earlier than asked; kill ends a long sleep
+void
+sleeptest(void)
+{
+  static int naps[] = { 0, 1, 5, 63, 64, 70, 130 };
+  int i, pid, t0;
+
+  printf(stdout, "sleep test\n");
+  for(i = 0; i < sizeof(naps)/sizeof(naps[0]); i++){
+    pid = fork();
+    if(pid < 0){
+      printf(stdout, "fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      t0 = uptime();
+      if(sleep(naps[i]) != 0 || uptime() - t0 < naps[i]){
+        printf(stdout, "sleep(%d) woke early\n", naps[i]);
+        exit();
+      }
+      exit();
+    }
+  }
+  for(i = 0; i < sizeof(naps)/sizeof(naps[0]); i++)
+    wait();
+
+  pid = fork();
+  if(pid == 0){
+    sleep(100000);
+    printf(stdout, "sleep outlived kill\n");
+    exit();
+  }
+  sleep(1);
+  kill(pid);
+  wait();
+  printf(stdout, "sleep test ok\n");
+}
+
+// a process pinned to one CPU keeps running there, and its
+// children inherit the pin; an empty mask is refused
+void
+affinitytest(void)
+{
+  int cpu, fds[2], i, j, pid;
+  char c;
+
+  printf(stdout, "affinity test\n");
+  if(setaffinity(getpid(), 0) != -1){
+    printf(stdout, "setaffinity accepted an empty mask\n");
+    exit();
+  }
+  // pin to CPU 0, then to CPU 1 if there is one
+  for(cpu = 0; cpu < 2; cpu++){
+    if(setaffinity(getpid(), 1 << cpu) != 0){
+      if(cpu == 0){
+        printf(stdout, "setaffinity failed\n");
+        exit();
+      }
+      break;
+    }
+    if(pipe(fds) != 0){
+      printf(stdout, "pipe() failed\n");
+      exit();
+    }
+    // children report running anywhere else through the pipe
+    for(i = 0; i < 4; i++){
+      pid = fork();
+      if(pid < 0){
+        printf(stdout, "fork failed\n");
+        exit();
+      }
+      if(pid == 0){
+        close(fds[0]);
+        for(j = 0; j < 20; j++){
+          if(getcpu() != cpu)
+            write(fds[1], "x", 1);
+          sleep(1);
+        }
+        exit();
+      }
+    }
+    close(fds[1]);
+    for(j = 0; j < 20; j++){
+      if(getcpu() != cpu){
+        printf(stdout, "process pinned to cpu %d ran on cpu %d\n", cpu, getcpu());
+        exit();
+      }
+      sleep(1);
+    }
+    for(i = 0; i < 4; i++)
+      wait();
+    if(read(fds[0], &c, 1) != 0){
+      printf(stdout, "child of a process pinned to cpu %d ran elsewhere\n", cpu);
+      exit();
+    }
+    close(fds[0]);
+  }
+  if(setaffinity(getpid(), ~0) != 0){
+    printf(stdout, "setaffinity could not unpin\n");
+    exit();
+  }
+  printf(stdout, "affinity test ok\n");
+}
+
+// settickets() takes counts from 1 to STRIDE1
+void
+ticketstest(void)
+{
+  printf(stdout, "tickets test\n");
+  if(settickets(0) != -1 || settickets(65537) != -1){
+    printf(stdout, "settickets accepted a bad count\n");
+    exit();
+  }
+  if(settickets(1) != 0 || settickets(100) != 0){
+    printf(stdout, "settickets failed\n");
+    exit();
+  }
+  printf(stdout, "tickets test ok\n");
+}
+
+// more processes than the old fixed table held, each found
+// by pid through the hash
+void
+manyproctest(void)
+{
+  int i, pids[200];
+
+  printf(stdout, "many proc test\n");
+  for(i = 0; i < 200; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
+      printf(stdout, "fork failed at %d\n", i);
+      exit();
+    }
+    if(pids[i] == 0)
+      for(;;) sleep(1000);
+  }
+  for(i = 0; i < 200; i++){
+    if(kill(pids[i]) != 0){
+      printf(stdout, "kill %d failed\n", pids[i]);
+      exit();
+    }
+  }
+  for(i = 0; i < 200; i++){
+    if(wait() < 0){
+      printf(stdout, "wait stopped early\n");
+      exit();
+    }
+  }
+  if(kill(pids[0]) != -1){
+    printf(stdout, "kill found a reaped process\n");
+    exit();
+  }
+  printf(stdout, "many proc test ok\n");
+}
+
+// threads share one address space: each fills its own part of
+// a buffer larger than the resident limit, so their faults page
+// the same memory in and out
+#define NTHREAD 4
+#define TPAGES  5
+char *tbuf;
+
+void
+threadfill(void *arg)
+{
+  int i, n;
+
+  n = (int)arg;
+  for(i = 0; i < TPAGES*4096; i++)
+    tbuf[n*TPAGES*4096 + i] = 'a' + n;
+  exit();
+}
+
+void
+threadsleep(void *arg)
+{
+  for(;;) sleep(1000);
+}
+
+char *tmap;
+int tbad;
+
+void
+threadtouch(void *arg)
+{
+  int i;
+
+  for(i = 0; i < TPAGES*4096; i += 4096)
+    if(tmap[i] != 'm')
+      tbad = 1;
+  exit();
+}
+
+void
+threadtest(void)
+{
+  void *stacks[NTHREAD], *stack;
+  int i, n, pid, fd;
+
+  printf(stdout, "thread test\n");
+  if(join(&stack) != -1){
+    printf(stdout, "join without threads succeeded\n");
+    exit();
+  }
+  tbuf = malloc(NTHREAD*TPAGES*4096);
+  for(n = 0; n < NTHREAD; n++){
+    stacks[n] = malloc(4096);
+    if(clone(threadfill, (void*)n, stacks[n]) < 0){
+      printf(stdout, "clone failed\n");
+      exit();
+    }
+  }
+  for(n = 0; n < NTHREAD; n++){
+    if(join(&stack) < 0){
+      printf(stdout, "join failed\n");
+      exit();
+    }
+    free(stack);
+  }
+  for(n = 0; n < NTHREAD; n++){
+    for(i = 0; i < TPAGES*4096; i++){
+      if(tbuf[n*TPAGES*4096 + i] != 'a' + n){
+        printf(stdout, "thread %d wrote nothing at %d\n", n, i);
+        exit();
+      }
+    }
+  }
+  free(tbuf);
+
+  // one thread read()s a file into an unfaulted mapping of that
+  // same file while another faults on the mapping
+  fd = open("threadfile", O_CREATE|O_RDWR);
+  memset(tmap = malloc(4096), 'm', 4096);
+  for(i = 0; i < TPAGES; i++)
+    write(fd, tmap, 4096);
+  free(tmap);
+  close(fd);
+  stack = malloc(4096);
+  for(n = 0; n < 10; n++){
+    fd = open("threadfile", 0);
+    tmap = mmap(0, TPAGES*4096, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if(tmap == MAP_FAILED || clone(threadtouch, 0, stack) < 0){
+      printf(stdout, "thread mmap failed\n");
+      exit();
+    }
+    if(read(fd, tmap, TPAGES*4096) != TPAGES*4096 || join(&stack) < 0 || tbad){
+      printf(stdout, "thread read into mapping failed\n");
+      exit();
+    }
+    munmap(tmap, TPAGES*4096);
+    close(fd);
+  }
+  free(stack);
+  unlink("threadfile");
+
+  // a process exiting takes its threads with it
+  pid = fork();
+  if(pid == 0){
+    clone(threadsleep, 0, malloc(4096));
+    exit();
+  }
+  if(wait() != pid){
+    printf(stdout, "wait for threaded child failed\n");
+    exit();
+  }
+  printf(stdout, "thread test ok\n");
+}
+
+// the stack guard page and the memory below the heap are
+// off limits to sbrk(), user code and system calls
+void
+vmatest(void)
+{
+  char *guard;
+  int fds[2], pid, ppid;
+
+  printf(stdout, "vma test\n");
+  guard = (char*)(((uint)&pid & ~4095) - 4096);
+  if(sbrk(-(int)sbrk(0)) != (char*)-1){
+    printf(stdout, "sbrk shrank the heap into the stack\n");
+    exit();
+  }
+  if(pipe(fds) != 0){
+    printf(stdout, "pipe() failed\n");
+    exit();
+  }
+  if(write(fds[1], guard, 1) != -1){
+    printf(stdout, "write from the guard page succeeded\n");
+    exit();
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  ppid = getpid();
+  pid = fork();
+  if(pid == 0){
+    *guard = 1;
+    printf(stdout, "oops could write the guard page %x\n", guard);
+    kill(ppid);
+    exit();
+  }
+  wait();
+  printf(stdout, "vma test ok\n");
+}
+
 void
 validatetest(void)
 {
@@ -1768,6 +2383,17 @@ main(int argc, char *argv[])
   bigargtest();
   bsstest();
   sbrktest();
+  madvisetest();
+  mmaptest();
+  hugetest();
+  memstattest();
+  mempressuretest();
+  sleeptest();
+  affinitytest();
+  ticketstest();
+  manyproctest();
+  threadtest();
+  vmatest();
   validatetest();
 
   opentest();
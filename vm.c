@@ -4,14 +4,49 @@
 #include "x86.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "elf.h"
+#include "mman.h"
+#include "stat.h"
+#include "fs.h"
+#include "file.h"
+#include "traps.h"
+#include "ppgc.h"
 
 #define BUF_SIZE PGSIZE / 4
 
 extern char data[]; // defined by kernel.ld
 pde_t *kpgdir;      // for use in scheduler()
 
+static int isClean(struct proc *proc, char *va, pte_t *pte);
+static int canEvict(struct proc *proc, char *va);
+static void flushPage(struct proc *proc, char *va, char *frame);
+static void shootdown(struct proc *proc);
+
+// Return the proc holding the address space of the running
+// thread: the thread itself, or the leader it shares it with.
+static struct proc *
+owner(void)
+{
+  return myproc()->leader;
+}
+
+// Lock the address space of the running thread against its
+// other threads, across a page fault or a change to its memory.
+// vmlock comes before any inode lock: a fault may read a mapped
+// file, so no inode may be locked while user memory is touched.
+void lockvm(void)
+{
+  acquiresleep(&owner()->vmlock);
+}
+
+void unlockvm(void)
+{
+  releasesleep(&owner()->vmlock);
+}
+
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
 void seginit(void)
@@ -32,7 +67,8 @@ void seginit(void)
 
 // Return the address of the PTE in page table pgdir
 // that corresponds to virtual address va.  If alloc!=0,
-// create any required page table pages.
+// create any required page table pages. Returns 0 if
+// va is mapped by a 4MB page, which has no PTE.
 static pte_t *
 walkpgdir(pde_t *pgdir, const void *va, int alloc)
 {
@@ -40,16 +76,17 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
   pte_t *pgtab;
 
   pde = &pgdir[PDX(va)];
+  if (*pde & PTE_PS)
+    return 0;
   if (*pde & PTE_P)
   { //if present
     pgtab = (pte_t *)P2V(PTE_ADDR(*pde));
   }
   else
   {
-    if (!alloc || (pgtab = (pte_t *)kalloc()) == 0)
-      return 0;
     // Make sure all those PTE_P bits are zero.
-    memset(pgtab, 0, PGSIZE);
+    if (!alloc || (pgtab = (pte_t *)kallocz()) == 0)
+      return 0;
     // The permissions here are overly generous, but they can
     // be further restricted by the permissions in the page table
     // entries, if necessary.
@@ -58,20 +95,118 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
   return &pgtab[PTX(va)];
 }
 
+// TLB shootdown. After the current process changes one of its
+// PTEs, other CPUs that have its page table loaded may still cache
+// the old translation. flushPage() invalidates the page locally and
+// queues it; shootdown() sends the queue to exactly those CPUs, one
+// IPI each, and waits until they have flushed. Frames queued with
+// their pages are freed only then, so no CPU can still reach them.
+static struct
+{
+  pde_t *pgdir;
+  int n;
+  uint va[NTLBFLUSH];
+  volatile uint pending; // CPUs that have yet to flush, one bit each
+} shoot[NCPU];
+
+// Invalidate user address va of the current process proc, after its
+// PTE changed, and free frame (if not 0) once no CPU can use it.
+static void
+flushPage(struct proc *proc, char *va, char *frame)
+{
+  invlpg(va);
+  if (proc->ntlb == NTLBFLUSH)
+    shootdown(proc);
+  proc->tlbva[proc->ntlb] = (uint)va;
+  proc->tlbfree[proc->ntlb] = frame;
+  proc->ntlb++;
+}
+
+// Flush the pages queued by proc on the other CPUs running
+// its address space, then free the queued frames.
+static void
+shootdown(struct proc *proc)
+{
+  struct cpu *c;
+  int i, me;
+  uint mask;
+
+  if (proc->ntlb == 0)
+    return;
+  pushcli();
+  me = mycpu() - cpus;
+  mask = 0;
+  __sync_synchronize(); // the PTE stores must be visible first
+  for (c = cpus; c < &cpus[ncpu]; c++)
+    if (c != mycpu() && c->pgdir == proc->pgdir)
+      mask |= 1 << (c - cpus);
+  if (mask != 0)
+  {
+    shoot[me].pgdir = proc->pgdir;
+    shoot[me].n = proc->ntlb;
+    memmove(shoot[me].va, proc->tlbva, proc->ntlb * sizeof(uint));
+    __sync_synchronize();
+    shoot[me].pending = mask;
+    for (i = 0; i < ncpu; i++)
+      if (mask & (1 << i))
+        lapicipi(cpus[i].apicid, T_TLBFLUSH);
+    // serve requests aimed at this CPU while waiting, or two CPUs
+    // shooting at each other would wait forever
+    while (shoot[me].pending)
+      tlbintr();
+  }
+  popcli();
+  for (i = 0; i < proc->ntlb; i++)
+    if (proc->tlbfree[i])
+      kfree(proc->tlbfree[i]);
+  proc->ntlb = 0;
+}
+
+// Carry out the TLB shootdowns other CPUs asked this one for.
+// Called with interrupts disabled.
+void tlbintr(void)
+{
+  int i, j;
+  uint me;
+
+  me = 1 << (mycpu() - cpus);
+  for (i = 0; i < ncpu; i++)
+  {
+    if ((shoot[i].pending & me) == 0)
+      continue;
+    // if another page table was loaded since, the entries are gone
+    if (rcr3() == V2P(shoot[i].pgdir))
+      for (j = 0; j < shoot[i].n; j++)
+        invlpg((void *)shoot[i].va[j]);
+    __sync_fetch_and_and(&shoot[i].pending, ~me);
+  }
+}
+
+// Unmap victim page va of proc, whose PTE is pte, on every CPU
+// before its frame changes hands. The PTE is left marked as
+// swapped out, or cleared if drop is set. Returns the frame.
+static char *
+evictVictim(struct proc *proc, char *va, pte_t *pte, int drop)
+{
+  char *frame;
+
+  frame = P2V(PTE_ADDR(*pte));
+  *pte = drop ? 0 : PTE_U | PTE_W | PTE_PG;
+  flushPage(proc, va, 0);
+  shootdown(proc);
+  return frame;
+}
 
 int checkAndClearFlag(char *va,int clear,int flag)
 { //checks if page at va has Access bit on and clears the bit
   uint accessed;
-  struct proc *proc = myproc();
+  struct proc *proc = owner();
   pte_t *pte = walkpgdir(proc->pgdir, (void *)va, 0);
   if (!*pte)
     panic("checkAndClearFlag: pte1 is empty");
   accessed = (*pte) & flag;
+  frametouch(*pte);
   if(clear) (*pte) &= ~flag;
-  #ifdef SCFIFO
-    if((uint)va <= 0x2000 && flag == PTE_A)
-    (*pte) |= PTE_A;
-  #endif
   return accessed;
 }
 // Create PTEs for virtual addresses starting at va that refer to
@@ -95,6 +230,8 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
       *pte = pa | perm | PTE_PG;
     else
       *pte = pa | perm | PTE_P;
+    if ((perm & (PTE_U | PTE_PG)) == PTE_U && frames && frames[pa / PGSIZE].owner == 0)
+      frames[pa / PGSIZE].owner = pgdir;
 
 
     if (a == last)
@@ -120,13 +257,16 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 //   KERNBASE..KERNBASE+EXTMEM: mapped to 0..EXTMEM (for I/O space)
 //   KERNBASE+EXTMEM..data: mapped to EXTMEM..V2P(data)
 //                for the kernel's instructions and r/o data
-//   data..KERNBASE+PHYSTOP: mapped to V2P(data)..PHYSTOP,
+//   data..KERNBASE+phystop: mapped to V2P(data)..phystop,
 //                                  rw data + free physical memory
 //   0xfe000000..0: mapped direct (devices such as ioapic)
 //
 // The kernel allocates physical memory for its heap and for user memory
-// between V2P(end) and the end of physical memory (PHYSTOP)
-// (directly addressable from end..P2V(PHYSTOP)).
+// between V2P(end) and the end of physical memory (phystop, found
+// by meminit) (directly addressable from end..P2V(phystop)).
+//
+// The second-level page tables for KERNBASE and above are built once,
+// for kpgdir, and every other page directory points at the same ones.
 
 // This table defines the kernel's mappings, which are present in
 // every process's page table.
@@ -137,10 +277,10 @@ static struct kmap
   uint phys_end;
   int perm;
 } kmap[] = {
-    {(void *)KERNBASE, 0, EXTMEM, PTE_W},            // I/O space
-    {(void *)KERNLINK, V2P(KERNLINK), V2P(data), 0}, // kern text+rodata
-    {(void *)data, V2P(data), PHYSTOP, PTE_W},       // kern data+memory
-    {(void *)DEVSPACE, DEVSPACE, 0, PTE_W},          // more devices
+    {(void *)KERNBASE, 0, EXTMEM, PTE_W | PTE_G},            // I/O space
+    {(void *)KERNLINK, V2P(KERNLINK), V2P(data), PTE_G},     // kern text+rodata
+    {(void *)data, V2P(data), 0, PTE_W | PTE_G},             // kern data+memory, up to phystop
+    {(void *)DEVSPACE, DEVSPACE, 0, PTE_W | PTE_G},          // more devices
 };
 
 // Added: helper function to get the number of '1' bits
@@ -163,11 +303,18 @@ setupkvm(void)
   pde_t *pgdir;
   struct kmap *k;
 
-  if ((pgdir = (pde_t *)kalloc()) == 0)
+  if ((pgdir = (pde_t *)kallocz()) == 0)
     return 0;
-  memset(pgdir, 0, PGSIZE);
-  if (P2V(PHYSTOP) > (void *)DEVSPACE)
-    panic("PHYSTOP too high");
+  if (kpgdir != 0)
+  {
+    // share the kernel's page tables
+    memmove(&pgdir[PDX(KERNBASE)], &kpgdir[PDX(KERNBASE)],
+            (NPDENTRIES - PDX(KERNBASE)) * sizeof(pde_t));
+    return pgdir;
+  }
+  if (P2V(phystop) > (void *)DEVSPACE)
+    panic("phystop too high");
+  kmap[2].phys_end = phystop;
   for (k = kmap; k < &kmap[NELEM(kmap)]; k++)
     if (mappages(pgdir, k->virt, k->phys_end - k->phys_start,
                  (uint)k->phys_start, k->perm) < 0)
@@ -213,6 +360,7 @@ void switchuvm(struct proc *p)
   // forbids I/O instructions (e.g., inb and outb) from user space
   mycpu()->ts.iomb = (ushort)0xFFFF;
   ltr(SEG_TSS << 3);
+  mycpu()->pgdir = p->pgdir;
   lcr3(V2P(p->pgdir)); // switch to process's address space
   popcli();
 }
@@ -225,8 +373,7 @@ void inituvm(pde_t *pgdir, char *init, uint sz)
 
   if (sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kallocz();
   mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W | PTE_U);
   memmove(mem, init, sz);
 }
@@ -265,22 +412,22 @@ int loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
 // TODO, split cases to NFUA and LAPA
 void nfuaSwap(uint addr) {
   int i, j;
-  struct proc  *proc =myproc();
+  struct proc *proc = owner();
   uint maxIndex = 0xffffffff, maxAge = 0;// MAX_POSSIBLE;
+  int drop;
+  char *frame, *victim;
   char buf[BUF_SIZE];
   pte_t *pte1, *pte2;
   struct freepg *chosen;
 
 
-  for (j = 3; j < MAX_PSYC_PAGES; j++)
-    if (proc->freepages[j].va != (char*)0xffffffff){
-      if (proc->freepages[j].age > maxAge){
+  for (j = 0; j < MAX_PSYC_PAGES; j++)
+    if (proc->freepages[j].va != (char*)0xffffffff && canEvict(proc, proc->freepages[j].va)){
+      if (maxIndex == -1 || proc->freepages[j].age > maxAge){
         maxAge = proc->freepages[j].age;
         maxIndex = j;
       }
     }
-  maxIndex = maxIndex == -1 && proc->freepages[3].age == maxAge ? 3 : maxIndex;
-
   if(maxIndex == -1)
     panic("nfuSwap: no free page to swap???");
   chosen = &proc->freepages[maxIndex];
@@ -289,6 +436,8 @@ void nfuaSwap(uint addr) {
   pte1 = walkpgdir(proc->pgdir, (void*)chosen->va, 0);
   if (!*pte1)
     panic("nfuSwap: pte1 is empty");
+  drop = isClean(proc, chosen->va, pte1);
+  victim = chosen->va;
 
 //  TODO verify: b4 accessing by writing to file,
 //  update accessed bit and age in case it misses a clock tick?
@@ -319,6 +468,7 @@ foundswappedpageslot:
   //set page table entry
   //TODO verify we're not setting PTE_U where we shouldn't be...
   *pte2 = PTE_ADDR(*pte1) | PTE_U | PTE_W | PTE_P;// access bit is zeroed...
+  frame = evictVictim(proc, victim, pte1, drop);
 
   for (j = 0; j < 4; j++) {
     int loc = (i * PGSIZE) + ((PGSIZE / 4) * j);
@@ -332,13 +482,18 @@ foundswappedpageslot:
     // cprintf("read:%d\n", read);//TODO delete
     //copy the old page from the memory to the swap file
     //written =
-    writeToSwapFile(proc, (char*)(P2V_WO(PTE_ADDR(*pte1)) + addroffset), loc, BUF_SIZE);
+    if (!drop)
+      writeToSwapFile(proc, frame + addroffset, loc, BUF_SIZE);
     // cprintf("written:%d\n", written);//TODO delete
     //copy the new page from buf to the memory
     memmove((void*)(PTE_ADDR(addr) + addroffset), (void*)buf, BUF_SIZE);
   }
   //update the page table entry flags, reset the physical page address
-  *pte1 = PTE_U | PTE_W | PTE_PG;
+  if (drop)
+  { // clean page: refilled on the next fault, free the slot
+    proc->swappedpages[i].va = (char *)0xffffffff;
+    proc->pagesInSwap--;
+  }
   //update l to hold the new va
   //l->next = proc->head;
   //proc->head = l;
@@ -351,22 +506,22 @@ foundswappedpageslot:
 // TODO, split cases to NFUA and LAPA
 void lapaSwap(uint addr) {
   int i, j;
-  struct proc  *proc =myproc();
+  struct proc *proc = owner();
   uint maxIndex = 0xffffffff, numOfOnes = 32;// MAX_POSSIBLE;
+  int drop;
+  char *frame, *victim;
   char buf[BUF_SIZE];
   pte_t *pte1, *pte2;
   struct freepg *chosen;
 
 
-  for (j = 3; j < MAX_PSYC_PAGES; j++)
-    if (proc->freepages[j].va != (char*)0xffffffff){
-      if (getOneBits(proc->freepages[j].age) < numOfOnes){
+  for (j = 0; j < MAX_PSYC_PAGES; j++)
+    if (proc->freepages[j].va != (char*)0xffffffff && canEvict(proc, proc->freepages[j].va)){
+      if (maxIndex == -1 || getOneBits(proc->freepages[j].age) < numOfOnes){
         numOfOnes = getOneBits(proc->freepages[j].age);
         maxIndex = j;
       }
     }
-  maxIndex = maxIndex == -1 && getOneBits(proc->freepages[3].age) == numOfOnes ? 3 : maxIndex;
-
   if(maxIndex == -1)
     panic("nfuSwap: no free page to swap???");
   chosen = &proc->freepages[maxIndex];
@@ -375,6 +530,8 @@ void lapaSwap(uint addr) {
   pte1 = walkpgdir(proc->pgdir, (void*)chosen->va, 0);
   if (!*pte1)
     panic("nfuSwap: pte1 is empty");
+  drop = isClean(proc, chosen->va, pte1);
+  victim = chosen->va;
 
 //  TODO verify: b4 accessing by writing to file,
 //  update accessed bit and age in case it misses a clock tick?
@@ -405,6 +562,7 @@ foundswappedpageslot:
   //set page table entry
   //TODO verify we're not setting PTE_U where we shouldn't be...
   *pte2 = PTE_ADDR(*pte1) | PTE_U | PTE_W | PTE_P;// access bit is zeroed...
+  frame = evictVictim(proc, victim, pte1, drop);
 
   for (j = 0; j < 4; j++) {
     int loc = (i * PGSIZE) + ((PGSIZE / 4) * j);
@@ -418,13 +576,18 @@ foundswappedpageslot:
     // cprintf("read:%d\n", read);//TODO delete
     //copy the old page from the memory to the swap file
     //written =
-    writeToSwapFile(proc, (char*)(P2V_WO(PTE_ADDR(*pte1)) + addroffset), loc, BUF_SIZE);
+    if (!drop)
+      writeToSwapFile(proc, frame + addroffset, loc, BUF_SIZE);
     // cprintf("written:%d\n", written);//TODO delete
     //copy the new page from buf to the memory
     memmove((void*)(PTE_ADDR(addr) + addroffset), (void*)buf, BUF_SIZE);
   }
   //update the page table entry flags, reset the physical page address
-  *pte1 = PTE_U | PTE_W | PTE_PG;
+  if (drop)
+  { // clean page: refilled on the next fault, free the slot
+    proc->swappedpages[i].va = (char *)0xffffffff;
+    proc->pagesInSwap--;
+  }
   //update l to hold the new va
   //l->next = proc->head;
   //proc->head = l;
@@ -438,7 +601,7 @@ void initFreePage(char *va)
 {
 #if defined(SCFIFO) || defined(AQ)
   int i;
-  struct proc *proc = myproc();
+  struct proc *proc = owner();
   for (i = 0; i < MAX_PSYC_PAGES; i++)
     if (proc->freepages[i].va == (char *)0xffffffff)
       goto foundlinked;
@@ -455,7 +618,7 @@ foundlinked:
   proc->pghead = &proc->freepages[i];
 
 #elif defined(NFUA) || defined(LAPA)
- struct proc * proc =myproc();
+ struct proc *proc = owner();
   int i;
   for (i = 0; i < MAX_PSYC_PAGES; i++)
     if (proc->freepages[i].va == (char*)0xffffffff)
@@ -466,14 +629,257 @@ foundlinked:
     proc->freepages[i].va = va;
 #endif
 
-  myproc()->pagesInRAM++;
- 
+  owner()->pagesInRAM++;
+
+}
+
+// Find the physical memory page descriptor holding va.
+static struct freepg *
+findFreePage(struct proc *proc, char *va)
+{
+  int i;
+  for (i = 0; i < MAX_PSYC_PAGES; i++)
+    if (proc->freepages[i].va == va)
+      return &proc->freepages[i];
+  return 0;
+}
+
+#if defined(SCFIFO) || defined(AQ)
+// Take pg out of the pages in physical memory linked list.
+static void
+unlinkFreePage(struct proc *proc, struct freepg *pg)
+{
+  if (pg->prev != 0)
+    pg->prev->next = pg->next;
+  else
+    proc->pghead = pg->next;
+  if (pg->next != 0)
+    pg->next->prev = pg->prev;
+  else
+    proc->pgtail = pg->prev;
+  pg->next = 0;
+  pg->prev = 0;
+}
+#endif
+
+#ifndef NONE
+// Forget the physical memory page descriptor of va.
+static void
+removeFreePage(struct proc *proc, char *va)
+{
+  struct freepg *pg;
+
+  if ((pg = findFreePage(proc, va)) == 0)
+    panic("deallocuvm: entry not found in proc->freepages");
+#if defined(SCFIFO) || defined(AQ)
+  unlinkFreePage(proc, pg);
+#endif
+  pg->va = (char *)0xffffffff;
+}
+#endif
+
+// Release the swap file slot holding va.
+static void
+freeSwapSlot(struct proc *proc, char *va)
+{
+  int i;
+  for (i = 0; i < MAX_PSYC_PAGES; i++)
+    if (proc->swappedpages[i].va == va)
+      goto found;
+  panic("deallocuvm: entry not found in proc->swappedpages");
+found:
+  proc->swappedpages[i].va = (char *)0xffffffff;
+  proc->swappedpages[i].age = 0;
+  proc->pagesInSwap--;
+}
+
+// Return the region of proc containing va, or 0.
+static struct vma *
+findVma(struct proc *proc, uint va)
+{
+  struct vma *v;
+
+  for (v = proc->vmas; v < &proc->vmas[proc->nvma]; v++)
+    if (va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Insert a region [start, end) of the given kind into proc's
+// sorted region list. Returns the new, otherwise zeroed entry,
+// or 0 if the list is full.
+static struct vma *
+newVma(struct proc *proc, uint start, uint end, int kind)
+{
+  struct vma *v;
+
+  if (proc->nvma == NVMA)
+    return 0;
+  for (v = proc->vmas; v < &proc->vmas[proc->nvma]; v++)
+    if (v->start > start)
+      break;
+  memmove(v + 1, v, (char *)&proc->vmas[proc->nvma] - (char *)v);
+  proc->nvma++;
+  memset(v, 0, sizeof(*v));
+  v->start = start;
+  v->end = end;
+  v->kind = kind;
+  return v;
+}
+
+// Drop region v of proc and its reference to the backing file.
+static void
+freeVma(struct proc *proc, struct vma *v)
+{
+  if (v->f)
+    fileclose(v->f);
+  if (v->ip)
+  {
+    begin_op();
+    iput(v->ip);
+    end_op();
+  }
+  memmove(v, v + 1, (char *)&proc->vmas[proc->nvma] - (char *)(v + 1));
+  proc->nvma--;
+}
+
+// Shrink region v to [start, end), keeping the backing of the
+// pages that remain.
+static void
+trimVma(struct vma *v, uint start, uint end)
+{
+  uint cut = start - v->start;
+
+  v->off += cut;
+  v->filesz = v->filesz > cut ? v->filesz - cut : 0;
+  if (v->filesz > end - start)
+    v->filesz = end - start;
+  v->start = start;
+  v->end = end;
+}
+
+// May the replacement policy pick the resident page at va?
+// The stack is in use by nearly every instruction, so it stays.
+// Pages outside any region only exist while exec() builds a
+// new image; they are fair game.
+static int
+canEvict(struct proc *proc, char *va)
+{
+  struct vma *v = findVma(proc, (uint)va);
+
+  return v == 0 || v->kind != VMA_STACK;
+}
+
+// Can the resident page at va be evicted without a swap slot?
+// True for pages the process never wrote to whose region can
+// recreate them: the next fault re-reads them from the
+// executable or file, or zero-fills them. So text is never
+// written to the swap file.
+static int
+isClean(struct proc *proc, char *va, pte_t *pte)
+{
+  struct vma *v;
+
+  if ((v = findVma(proc, (uint)va)) == 0 || (*pte & PTE_D))
+    return 0;
+  switch (v->kind)
+  {
+  case VMA_TEXT:
+  case VMA_DATA:
+    return v->ip != 0; // initcode has no executable to re-read
+  case VMA_HEAP:
+    return 1;
+  case VMA_MMAP:
+    return (v->flags & MAP_SHARED) == 0;
+  }
+  // exec() copies the arguments onto the stack through the
+  // kernel mapping, leaving PTE_D clear
+  return 0;
+}
+
+// Evict the page at va by simply dropping it, if it is clean.
+static int
+dropClean(struct proc *proc, char *va)
+{
+  pte_t *pte = walkpgdir(proc->pgdir, va, 0);
+  char *mem;
+
+  if (pte == 0 || (*pte & PTE_P) == 0 || !isClean(proc, va, pte))
+    return 0;
+  mem = P2V(PTE_ADDR(*pte));
+  *pte = 0;
+  flushPage(proc, va, mem);
+  return 1;
+}
+
+// Write the resident page at va to swap file slot, then free its
+// frame. The page is unmapped on every CPU before it is copied, so
+// no store to it can be lost.
+static int
+swapOut(struct proc *proc, char *va, int slot)
+{
+  pte_t *pte = walkpgdir(proc->pgdir, va, 0);
+  pte_t old;
+  char *mem;
+
+  if (pte == 0 || (*pte & PTE_P) == 0)
+    panic("swapOut: page not present");
+  old = *pte;
+  mem = P2V(PTE_ADDR(old));
+  *pte = PTE_W | PTE_U | PTE_PG;
+  flushPage(proc, va, 0);
+  shootdown(proc);
+  if (writeToSwapFile(proc, mem, slot * PGSIZE, PGSIZE) != PGSIZE)
+  {
+    *pte = old;
+    return 0;
+  }
+  proc->swappedpages[slot].va = va;
+  kfree(mem);
+  ++proc->totalPagedOut;
+  ++proc->pagesInSwap;
+  return 1;
+}
+
+// Re-rank a resident page for the active replacement policy:
+// evict != 0 makes pg the next victim, evict == 0 the last one.
+static void
+rankPage(struct proc *proc, struct freepg *pg, int evict)
+{
+  if (evict)
+    checkAndClearFlag(pg->va, 1, PTE_A);
+#if defined(SCFIFO) || defined(AQ)
+  // victims are taken from the tail
+  unlinkFreePage(proc, pg);
+  if (evict)
+  {
+    pg->prev = proc->pgtail;
+    if (proc->pgtail != 0)
+      proc->pgtail->next = pg;
+    else
+      proc->pghead = pg;
+    proc->pgtail = pg;
+  }
+  else
+  {
+    pg->next = proc->pghead;
+    if (proc->pghead != 0)
+      proc->pghead->prev = pg;
+    else
+      proc->pgtail = pg;
+    proc->pghead = pg;
+  }
+#elif defined(NFUA)
+  pg->age = evict ? 0xffffffff : 0; // nfuaWrite takes the largest counter
+#elif defined(LAPA)
+  pg->age = evict ? 0 : 0xffffffff; // lapaWrite takes the fewest set bits
+#endif
 }
 struct freepg *scWrite(char *va)
 {
   int i;
   struct freepg *curr, *oldpgtail;
-  struct proc *proc = myproc();
+  struct proc *proc = owner();
   for (i = 0; i < MAX_PSYC_PAGES; i++)
   {
     if (proc->swappedpages[i].va == (char *)0xffffffff)
@@ -501,7 +907,7 @@ foundswappedpageslot:
     curr = proc->pgtail;
   } while (checkAndClearFlag(proc->pghead->va,1,PTE_A) && curr != oldpgtail);
 
-if((uint)proc->pghead->va <= 0x2000){//not to swap user data pages
+while(!canEvict(proc, proc->pghead->va)){
     curr = proc->pgtail;
   oldpgtail = proc->pgtail;
     do
@@ -516,24 +922,14 @@ if((uint)proc->pghead->va <= 0x2000){//not to swap user data pages
     curr = proc->pgtail;
   } while (checkAndClearFlag(proc->pghead->va,1,PTE_A) && curr != oldpgtail);
   }
-  //make the swap
-  proc->swappedpages[i].va = proc->pghead->va;
-  int num = 0;
+  if (dropClean(proc, proc->pghead->va))
+  {
+    proc->pghead->va = va;
+    return proc->pghead;
+  }
   //write head of physical pages to swapfile
-  if ((num = writeToSwapFile(proc, (char *)PTE_ADDR(proc->pghead->va), i * PGSIZE, PGSIZE)) == 0)
+  if (swapOut(proc, proc->pghead->va, i) == 0)
     return 0;
-
-  pte_t *pte1 = walkpgdir(proc->pgdir, (void *)proc->pghead->va, 0);
-  if (!*pte1)
-    panic("writePageToSwapFile: pte1 is empty");
-
-  kfree((char *)PTE_ADDR(P2V_WO(*walkpgdir(proc->pgdir, proc->pghead->va, 0))));
-  *pte1 = PTE_W | PTE_U | PTE_PG;
-  ++proc->totalPagedOut;
-  ++proc->pagesInSwap;
-
-  //refresh TLB
-  lcr3(V2P(proc->pgdir));
   proc->pghead->va = va;
 
   return proc->pghead;
@@ -546,7 +942,7 @@ struct freepg *lapaWrite(char *va) {
   int i, j;
   uint ind = -1, maxOnes = 32; //MAX_POSSIBLE;
   struct freepg *chosen;
-  struct proc * proc =myproc();
+  struct proc *proc = owner();
 
   for (i = 0; i < MAX_PSYC_PAGES; i++){
     // checking for available slot 
@@ -556,16 +952,15 @@ struct freepg *lapaWrite(char *va) {
   panic("writePageToSwapFile: LAPA no slot for swapped page");
 
 foundswappedpageslot:
-  for (j = 3; j < MAX_PSYC_PAGES; j++){
+  for (j = 0; j < MAX_PSYC_PAGES; j++){
   //  cprintf("one bits in page j=%d age is: %d \nand freepages va is: ", j, getOneBits(proc->freepages[j].age), proc->freepages[j].va);
-    if (proc->freepages[j].va != (char*)0xffffffff){
-      if (getOneBits(proc->freepages[j].age) < maxOnes){
+    if (proc->freepages[j].va != (char*)0xffffffff && canEvict(proc, proc->freepages[j].va)){
+      if (ind == -1 || getOneBits(proc->freepages[j].age) < maxOnes){
         maxOnes = getOneBits(proc->freepages[j].age);
         ind = j;
       }
     }
   }
-  ind = ind == -1 && getOneBits(proc->freepages[3].age) == maxOnes ? 3 : ind;
   if(ind == -1)
     panic("lapaWrite: no free page to swap");
   chosen = &proc->freepages[ind];
@@ -584,18 +979,14 @@ foundswappedpageslot:
   }
   release(&tickslock);
 
+  if (dropClean(proc, chosen->va))
+  {
+    chosen->va = va;
+    return chosen;
+  }
   //make swap
-  proc->swappedpages[i].va = chosen->va;
-  int num = 0;
-  if ((num = writeToSwapFile(proc, (char*)PTE_ADDR(chosen->va), i * PGSIZE, PGSIZE)) == 0)
+  if (swapOut(proc, chosen->va, i) == 0)
     return 0;
-
-  kfree((char*)PTE_ADDR(P2V_WO(*walkpgdir(proc->pgdir, chosen->va, 0))));
-  *pte1 = PTE_W | PTE_U | PTE_PG;
-  ++proc->totalPagedOut;
-  ++proc->pagesInSwap;
-
-  lcr3(V2P(proc->pgdir));
   chosen->va = va;
 
   return chosen;
@@ -608,7 +999,7 @@ struct freepg *nfuaWrite(char *va) {
   int i, j;
   uint maxIndex = -1, maxAge = 0; //MAX_POSSIBLE;
   struct freepg *chosen;
-  struct proc * proc =myproc();
+  struct proc *proc = owner();
 
   for (i = 0; i < MAX_PSYC_PAGES; i++){
     // checking for available slot 
@@ -618,16 +1009,15 @@ struct freepg *nfuaWrite(char *va) {
   panic("writePageToSwapFile: NFUA no slot for swapped page");
 
 foundswappedpageslot:
-  for (j = 3; j < MAX_PSYC_PAGES; j++){
-    if (proc->freepages[j].va != (char*)0xffffffff){
+  for (j = 0; j < MAX_PSYC_PAGES; j++){
+    if (proc->freepages[j].va != (char*)0xffffffff && canEvict(proc, proc->freepages[j].va)){
       // cprintf("proc->freepages[j].va = %x ,age=%x , j=%d , maxAge=%x\n",proc->freepages[j].va,proc->freepages[j].age,j,maxAge);
-      if (proc->freepages[j].age > maxAge){
+      if (maxIndex == -1 || proc->freepages[j].age > maxAge){
         maxAge = proc->freepages[j].age;
         maxIndex = j;
       }
     }
   }
-  maxIndex = maxIndex == -1 && proc->freepages[3].age == maxAge ? 3 : maxIndex;
   if(maxIndex == -1)
     panic("nfuaWrite: no free page to swap");
   chosen = &proc->freepages[maxIndex];
@@ -646,18 +1036,14 @@ foundswappedpageslot:
   }
   release(&tickslock);
 
+  if (dropClean(proc, chosen->va))
+  {
+    chosen->va = va;
+    return chosen;
+  }
   //make swap
-  proc->swappedpages[i].va = chosen->va;
-  int num = 0;
-  if ((num = writeToSwapFile(proc, (char*)PTE_ADDR(chosen->va), i * PGSIZE, PGSIZE)) == 0)
+  if (swapOut(proc, chosen->va, i) == 0)
     return 0;
-
-  kfree((char*)PTE_ADDR(P2V_WO(*walkpgdir(proc->pgdir, chosen->va, 0))));
-  *pte1 = PTE_W | PTE_U | PTE_PG;
-  ++proc->totalPagedOut;
-  ++proc->pagesInSwap;
-
-  lcr3(V2P(proc->pgdir));
   chosen->va = va;
 
   return chosen;
@@ -668,7 +1054,7 @@ struct freepg *aqWrite(char *va)
 {
   int i;
   struct freepg *curr;
-  struct proc *proc = myproc();
+  struct proc *proc = owner();
   for (i = 3; i < MAX_PSYC_PAGES; i++)
   {
     if (proc->swappedpages[i].va == (char *)0xffffffff)
@@ -690,26 +1076,16 @@ do{
   curr->next = proc->pghead;
   proc->pghead->prev = curr;
   proc->pghead = curr;
-}while((uint)proc->pghead->va <= 0x2000);
+}while(!canEvict(proc, proc->pghead->va));
 
-  //make the swap
-  proc->swappedpages[i].va = proc->pghead->va;
-  int num = 0;
+  if (dropClean(proc, proc->pghead->va))
+  {
+    proc->pghead->va = va;
+    return proc->pghead;
+  }
   //write head of physical pages to swapfile
-  if ((num = writeToSwapFile(proc, (char *)PTE_ADDR(proc->pghead->va), i * PGSIZE, PGSIZE)) == 0)
+  if (swapOut(proc, proc->pghead->va, i) == 0)
     return 0;
-
-  pte_t *pte1 = walkpgdir(proc->pgdir, (void *)proc->pghead->va, 0);
-  if (!*pte1)
-    panic("writePageToSwapFile: pte1 is empty");
-
-  kfree((char *)PTE_ADDR(P2V_WO(*walkpgdir(proc->pgdir, proc->pghead->va, 0))));
-  *pte1 = PTE_W | PTE_U | PTE_PG;
-  ++proc->totalPagedOut;
-  ++proc->pagesInSwap;
-
-  //refresh TLB
-  lcr3(V2P(proc->pgdir));
   proc->pghead->va = va;
 
   return proc->pghead;
@@ -717,22 +1093,24 @@ do{
 
 struct freepg *writePageToSwapFile(char *va)
 {
+  struct freepg *pg = 0;
 #ifdef SCFIFO
-  return scWrite(va);
+  pg = scWrite(va);
 #else
 #ifdef AQ
-  return aqWrite(va);
+  pg = aqWrite(va);
 #else
 #ifdef NFUA
-    return nfuaWrite(va);
+    pg = nfuaWrite(va);
 #else
 #ifdef LAPA
-    return lapaWrite(va);
+    pg = lapaWrite(va);
 #endif
 #endif
 #endif
 #endif
-  return 0;
+  shootdown(owner()); // a clean victim was only queued
+  return pg;
 }
 // Allocate page tables and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
@@ -745,7 +1123,7 @@ int allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
   struct freepg *pg;
 #endif
 
-  if (newsz >= KERNBASE)
+  if (newsz > MMAPBASE)
     return 0;
   if (newsz < oldsz)
     return oldsz;
@@ -754,19 +1132,19 @@ int allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
   for (; a < newsz; a += PGSIZE)
   {
 #ifndef NONE
-    if (myproc()->pagesInRAM >= MAX_PSYC_PAGES)
+    if (owner()->pagesInRAM >= MAX_PSYC_PAGES)
     {
       if ((pg = writePageToSwapFile((char *)a)) == 0)
         panic("allocuvm: error writing page to swap file");
 #ifdef CSFIFO
       pg->va = (char *)a;
-      pg->next = myproc()->pghead;
-      myproc()->pghead = pg;
+      pg->next = owner()->pghead;
+      owner()->pghead = pg;
 #endif
       newpage = 0;
     }
 #endif
-    mem = kalloc();
+    mem = kallocz();
     if (mem == 0)
     {
       cprintf("allocuvm out of memory\n");
@@ -779,7 +1157,6 @@ int allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       initFreePage((char *)a);
     }
 #endif
-    memset(mem, 0, PGSIZE);
     if (mappages(pgdir, (char *)a, PGSIZE, V2P(mem), PTE_W | PTE_U) < 0)
     {
       cprintf("allocuvm out of memory (2)\n");
@@ -799,14 +1176,21 @@ int deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 {
   pte_t *pte;
   uint a, pa;
-  int i;
-  struct proc *proc = myproc();
+  struct proc *proc = owner();
   if (newsz >= oldsz)
     return oldsz;
 
   a = PGROUNDUP(newsz);
   for (; a < oldsz; a += PGSIZE)
   {
+    if (pgdir[PDX(a)] & PTE_PS)
+    {
+      // a MAP_HUGE page, going away with the whole of pgdir
+      kfreeblock(P2V(PTE_ADDR(pgdir[PDX(a)])), KMAXORDER);
+      pgdir[PDX(a)] = 0;
+      a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
     pte = walkpgdir(pgdir, (char *)a, 0);
     if (!pte)
       a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
@@ -817,6 +1201,8 @@ int deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
         panic("kfree");
 
       }
+      char *v = P2V(pa);
+      *pte = 0;
       if (proc->pgdir == pgdir)
       {
         /*
@@ -824,51 +1210,13 @@ int deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
         argument. Update proc's data structure accordingly.
         */
 #ifndef NONE
-        for (i = 0; i < MAX_PSYC_PAGES; i++)
-        {
-          if (proc->freepages[i].va == (char *)a)
-            goto founddeallocuvmPTEP;
-        }
-
-        panic("deallocuvm: entry not found in proc->freepages");
-      founddeallocuvmPTEP:
-        myproc()->freepages[i].va = (char *)0xffffffff;
-#if defined(SCFIFO) || defined(AQ)
-        if (proc->pghead == &proc->freepages[i])
-        {
-          proc->pghead = proc->freepages[i].next;
-          if (proc->pghead != 0)
-            proc->pghead->prev = 0;
-          goto doneLooking;
-        }
-        if (proc->pgtail == &proc->freepages[i])
-        {
-          proc->pgtail = proc->freepages[i].prev;
-          if (proc->pgtail != 0) 
-            proc->pgtail->next = 0;
-          goto doneLooking;
-        }
-        struct freepg *l = proc->pghead;
-        while (l->next != 0 && l->next != &proc->freepages[i])
-        {
-          l = l->next;
-        }
-        l->next = proc->freepages[i].next;
-        if (proc->freepages[i].next != 0)
-        {
-          proc->freepages[i].next->prev = l;
-        }
-
-      doneLooking:
-        proc->freepages[i].next = 0;
-        proc->freepages[i].prev = 0;
-#endif
+        removeFreePage(proc, (char *)a);
 #endif
         proc->pagesInRAM--;
+        flushPage(proc, (char *)a, v);
       }
-      char *v = P2V(pa);
-      kfree(v);
-      *pte = 0;
+      else
+        kfree(v);
     }
     else if (*pte & PTE_PG && proc->pgdir == pgdir)
     {
@@ -876,18 +1224,11 @@ int deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       The process itself is deallocating pages via sbrk() with a negative
       argument. Update proc's data structure accordingly.
       */
-      for (i = 0; i < MAX_PSYC_PAGES; i++)
-      {
-        if (proc->swappedpages[i].va == (char *)a)
-          goto founddeallocuvmPTEPG;
-      }
-      panic("deallocuvm: entry not found in proc->swappedpages");
-    founddeallocuvmPTEPG:
-      proc->swappedpages[i].va = (char *)0xffffffff;
-      proc->swappedpages[i].age = 0;
-      proc->pagesInSwap--;
+      freeSwapSlot(proc, (char *)a);
     }
   }
+  if (proc->pgdir == pgdir)
+    shootdown(proc);
   return newsz;
 }
 
@@ -900,7 +1241,8 @@ void freevm(pde_t *pgdir)
   if (pgdir == 0)
     panic("freevm: no pgdir");
   deallocuvm(pgdir, KERNBASE, 0);
-  for (i = 0; i < NPDENTRIES; i++)
+  // the page tables above KERNBASE belong to kpgdir
+  for (i = 0; i < PDX(KERNBASE); i++)
   {
     if (pgdir[i] & PTE_P)
     {
@@ -911,18 +1253,6 @@ void freevm(pde_t *pgdir)
   kfree((char *)pgdir);
 }
 
-// Clear PTE_U on a page. Used to create an inaccessible
-// page beneath the user stack.
-void clearpteu(pde_t *pgdir, char *uva)
-{
-  pte_t *pte;
-
-  pte = walkpgdir(pgdir, uva, 0);
-  if (pte == 0)
-    panic("clearpteu");
-  *pte &= ~PTE_U;
-}
-
 // Given a parent process's page table, create a copy
 // of it for a child.
 pde_t *
@@ -937,23 +1267,24 @@ copyuvm(pde_t *pgdir, uint sz)
     return 0;
   for (i = 0; i < sz; i += PGSIZE)
   {
-    if ((pte = walkpgdir(pgdir, (void *)i, 0)) == 0)
-      panic("copyuvm: pte should exist");
-    if (!(*pte & PTE_P) && !(*pte & PTE_PG))//changed condition to include PG
-    {
-      panic("copyuvm: page not present");
-    }
+    // the stack guard page and dropped pages have no frame; the
+    // child fills them in on demand from its regions
+    if ((pte = walkpgdir(pgdir, (void *)i, 0)) == 0 || *pte == 0)
+      continue;
     pa = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
-   
+    if (flags & PTE_PG)
+    {
+      // the contents come along with the copy of the swap file
+      if (mappages(d, (void *)i, PGSIZE, 0, flags) < 0)
+        goto bad;
+      continue;
+    }
     if ((mem = kalloc()) == 0)
       goto bad;
     memmove(mem, (char *)P2V(pa), PGSIZE);
     if (mappages(d, (void *)i, PGSIZE, V2P(mem), flags) < 0)
       goto bad;
-    if(!(flags & PTE_P))//maybe not needed
-      (*pte) ^= PTE_P;
-    
   }
   return d;
 
@@ -1004,8 +1335,10 @@ int copyout(pde_t *pgdir, uint va, void *p, uint len)
 }
 void scSwap(uint addr)
 {
-  struct proc *proc = myproc();
+  struct proc *proc = owner();
   int i, j;
+  int drop;
+  char *frame, *victim;
   char buf[BUF_SIZE];
   pte_t *pte1, *pte2;
   struct freepg *curr, *oldpgtail;
@@ -1029,7 +1362,7 @@ void scSwap(uint addr)
     curr = proc->pgtail;
  
   } while (checkAndClearFlag(proc->pghead->va,1,PTE_A) && curr != oldpgtail);
-  if((uint)proc->pghead->va <= 0x2000){
+  while(!canEvict(proc, proc->pghead->va)){
     curr = proc->pgtail;
   oldpgtail = proc->pgtail;
     do
@@ -1048,6 +1381,8 @@ void scSwap(uint addr)
   pte1 = walkpgdir(proc->pgdir, (void *)proc->pghead->va, 0);
   if (!*pte1)
     panic("swapFile: SCFIFO pte1 is empty");
+  drop = isClean(proc, proc->pghead->va, pte1);
+  victim = proc->pghead->va;
 
   //find a swap file page descriptor slot
   for (i = 0; i < MAX_PSYC_PAGES; i++)
@@ -1067,6 +1402,7 @@ foundswappedpageslot:
   //set page table entry
   //TODO verify we're not setting PTE_U where we shouldn't be...
   *pte2 = PTE_ADDR(*pte1) | PTE_U | PTE_W | PTE_P; // access bit is zeroed...
+  frame = evictVictim(proc, victim, pte1, drop);
 
   for (j = 0; j < 4; j++)
   {
@@ -1081,13 +1417,18 @@ foundswappedpageslot:
     // cprintf("read:%d\n", read);//TODO delete
     //copy the old page from the memory to the swap file
     //written =
-    writeToSwapFile(proc, (char *)(P2V_WO(PTE_ADDR(*pte1)) + addroffset), loc, BUF_SIZE);
+    if (!drop)
+      writeToSwapFile(proc, frame + addroffset, loc, BUF_SIZE);
     // cprintf("written:%d\n", written);//TODO delete
     //copy the new page from buf to the memory
     memmove((void *)(PTE_ADDR(addr) + addroffset), (void *)buf, BUF_SIZE);
   }
   //update the page table entry flags, reset the physical page address
-  *pte1 = PTE_U | PTE_W | PTE_PG;
+  if (drop)
+  { // clean page: refilled on the next fault, free the slot
+    proc->swappedpages[i].va = (char *)0xffffffff;
+    proc->pagesInSwap--;
+  }
   //update l to hold the new va
   //l->next = proc->pghead;
   //proc->pghead = l;
@@ -1095,8 +1436,10 @@ foundswappedpageslot:
 }
 void aqSwap(uint addr)
 {
-  struct proc *proc = myproc();
+  struct proc *proc = owner();
   int i, j;
+  int drop;
+  char *frame, *victim;
   char buf[BUF_SIZE];
   pte_t *pte1, *pte2;
   struct freepg *curr;
@@ -1115,11 +1458,13 @@ do{
   curr->next = proc->pghead;
   proc->pghead->prev = curr;
   proc->pghead = curr;
-}while((uint)proc->pghead->va <= 0x2000);//swap only user private pages
+}while(!canEvict(proc, proc->pghead->va));
 
   pte1 = walkpgdir(proc->pgdir, (void *)proc->pghead->va, 0);
   if (!*pte1)
     panic("swapFile: AQ pte1 is empty");
+  drop = isClean(proc, proc->pghead->va, pte1);
+  victim = proc->pghead->va;
 
   //find a swap file page descriptor slot
   for (i = 0; i < MAX_PSYC_PAGES; i++)
@@ -1140,6 +1485,7 @@ foundswappedpageslot:
   //set page table entry
   //TODO verify we're not setting PTE_U where we shouldn't be...
   *pte2 = PTE_ADDR(*pte1) | PTE_U | PTE_W | PTE_P; // access bit is zeroed...
+  frame = evictVictim(proc, victim, pte1, drop);
 
   for (j = 0; j < 4; j++)
   {
@@ -1154,27 +1500,30 @@ foundswappedpageslot:
     // cprintf("read:%d\n", read);//TODO delete
     //copy the old page from the memory to the swap file
     //written =
-    writeToSwapFile(proc, (char *)(P2V_WO(PTE_ADDR(*pte1)) + addroffset), loc, BUF_SIZE);
+    if (!drop)
+      writeToSwapFile(proc, frame + addroffset, loc, BUF_SIZE);
     // cprintf("written:%d\n", written);//TODO delete
     //copy the new page from buf to the memory
     memmove((void *)(PTE_ADDR(addr) + addroffset), (void *)buf, BUF_SIZE);
   }
   //update the page table entry flags, reset the physical page address
-  *pte1 = PTE_U | PTE_W | PTE_PG;
+  if (drop)
+  { // clean page: refilled on the next fault, free the slot
+    proc->swappedpages[i].va = (char *)0xffffffff;
+    proc->pagesInSwap--;
+  }
   //update l to hold the new va
   //l->next = proc->pghead;
   //proc->pghead = l;
   proc->pghead->va = (char *)PTE_ADDR(addr);
 }
 
-void handlePageFault(uint addr)
+// Swap the page at addr in from the swap file, exchanging it
+// with the victim chosen by the replacement policy.
+static void
+swapIn(uint addr)
 {
-  struct proc *proc = myproc();
-  if (strcmp(proc->name, "init") == 0 || strcmp(proc->name, "sh") == 0)
-  {
-    proc->pagesInRAM++;
-    return;
-  }
+  struct proc *proc = owner();
 #ifdef SCFIFO
   scSwap(addr);
 #else
@@ -1191,10 +1540,740 @@ void handlePageFault(uint addr)
 #endif
 #endif
 
-  lcr3(V2P(proc->pgdir));
   ++proc->totalPagedOut;
 }
 
+// Mark the n frames at mem, mapped by pgdir, as never paged out.
+static void
+pinFrames(pde_t *pgdir, char *mem, int n)
+{
+  struct frame *f;
+
+  for (f = &frames[V2P(mem) / PGSIZE]; n > 0; n--, f++)
+  {
+    f->owner = pgdir;
+    f->flags |= FRAME_PINNED;
+  }
+}
+
+// Read n bytes at offset off of ip into frame mem.
+static int
+readBacking(struct inode *ip, char *mem, uint off, int n)
+{
+  ilock(ip);
+  n = off < ip->size ? readi(ip, mem, off, n) : 0;
+  iunlock(ip);
+  return n;
+}
+
+// Fill in the page at addr of region v from its backing: the
+// executable or file, zeros past the end of that.
+static int
+fillPage(struct proc *proc, struct vma *v, uint addr)
+{
+  char *mem;
+  int perm, n;
+  uint off;
+#ifndef NONE
+  uint newpage = 1;
+
+  // shared pages are pinned: only private ones join the paging lists
+  if ((v->flags & MAP_SHARED) == 0 && proc->pagesInRAM >= MAX_PSYC_PAGES)
+  {
+    if (writePageToSwapFile((char *)addr) == 0)
+      return -1;
+    newpage = 0;
+  }
+#endif
+  perm = PTE_U;
+  if (v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if ((mem = kallocz()) == 0)
+    return -1;
+  off = addr - v->start;
+  n = 0;
+  if (off < v->filesz)
+  {
+    n = v->filesz - off < PGSIZE ? v->filesz - off : PGSIZE;
+    n = readBacking(v->f != 0 ? v->f->ip : v->ip, mem, v->off + off, n);
+  }
+  if (n < 0 || mappages(proc->pgdir, (char *)addr, PGSIZE, V2P(mem), perm) < 0)
+  {
+    kfree(mem);
+    return -1;
+  }
+#ifndef NONE
+  if ((v->flags & MAP_SHARED) == 0 && newpage)
+    initFreePage((char *)addr);
+#endif
+  if (v->flags & MAP_SHARED)
+    pinFrames(proc->pgdir, mem, 1);
+  return 0;
+}
+
+// Map the whole 4MB-aligned chunk around addr with one large page,
+// if region v covers all of it and nothing in it is mapped yet.
+// Large pages are pinned: they stay out of the paging lists.
+// Returns -1 if the caller should fall back to a small page.
+static int
+fillHuge(struct proc *proc, struct vma *v, uint addr)
+{
+  uint a = addr & ~(HUGEPGSIZE - 1);
+  char *mem;
+
+  if (a < v->start || a + HUGEPGSIZE > v->end || proc->pgdir[PDX(a)] != 0)
+    return -1;
+  if ((mem = kallocblock(KMAXORDER)) == 0)
+    return -1;
+  memset(mem, 0, HUGEPGSIZE);
+  pinFrames(proc->pgdir, mem, NPTENTRIES);
+  proc->pgdir[PDX(a)] = V2P(mem) | PTE_PS | PTE_P | PTE_U |
+                        ((v->prot & PROT_WRITE) ? PTE_W : 0);
+  return 0;
+}
+
+// Replace the large page around addr by a page table mapping the
+// same frames with small pages, which can then be unmapped one by
+// one. The small pages stay pinned like the large one was.
+static int
+splitHuge(struct proc *proc, uint addr)
+{
+  uint a = addr & ~(HUGEPGSIZE - 1);
+  pde_t pde = proc->pgdir[PDX(a)];
+  pte_t *pgtab;
+  int i;
+
+  if ((pgtab = (pte_t *)kalloc()) == 0)
+    return -1;
+  for (i = 0; i < NPTENTRIES; i++)
+    pgtab[i] = (PTE_ADDR(pde) + i * PGSIZE) | (PTE_FLAGS(pde) & ~PTE_PS);
+  proc->pgdir[PDX(a)] = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
+  flushPage(proc, (char *)a, 0);
+  shootdown(proc);
+  return 0;
+}
+
+// Split the large pages that [start, end) covers only in part.
+static int
+splitRange(struct proc *proc, uint start, uint end)
+{
+  if (start % HUGEPGSIZE && (proc->pgdir[PDX(start)] & PTE_PS) &&
+      splitHuge(proc, start) < 0)
+    return -1;
+  if (end % HUGEPGSIZE && (proc->pgdir[PDX(end)] & PTE_PS) &&
+      splitHuge(proc, end) < 0)
+    return -1;
+  return 0;
+}
+
+// Unmap the large page at a and free its frame.
+static void
+dropHuge(struct proc *proc, uint a)
+{
+  char *mem = P2V(PTE_ADDR(proc->pgdir[PDX(a)]));
+
+  proc->pgdir[PDX(a)] = 0;
+  flushPage(proc, (char *)a, 0);
+  shootdown(proc);
+  kfreeblock(mem, KMAXORDER);
+}
+
+// Give page directory pgdir of a fork child its own copy of the
+// large page pde at a: a large page again if one is free, else
+// small pinned pages.
+static int
+copyHuge(pde_t *pgdir, uint a, pde_t pde)
+{
+  char *mem, *src = P2V(PTE_ADDR(pde));
+  uint off;
+
+  if ((mem = kallocblock(KMAXORDER)) != 0)
+  {
+    memmove(mem, src, HUGEPGSIZE);
+    pinFrames(pgdir, mem, NPTENTRIES);
+    pgdir[PDX(a)] = V2P(mem) | PTE_FLAGS(pde);
+    return 0;
+  }
+  for (off = 0; off < HUGEPGSIZE; off += PGSIZE)
+  {
+    if ((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, src + off, PGSIZE);
+    if (mappages(pgdir, (char *)a + off, PGSIZE, V2P(mem),
+                 PTE_FLAGS(pde) & ~PTE_PS) < 0)
+    {
+      kfree(mem);
+      return -1;
+    }
+    pinFrames(pgdir, mem, 1);
+  }
+  return 0;
+}
+
+// Return the madvise() hint covering va.
+static int
+getAdvice(struct proc *proc, uint va)
+{
+  struct madvrange *r;
+
+  for (r = proc->madv; r < &proc->madv[NMADV]; r++)
+    if (r->advice != MADV_NORMAL && va >= r->start && va < r->end)
+      return r->advice;
+  return MADV_NORMAL;
+}
+
+// Record advice for [start, end), replacing older hints there.
+static int
+setAdvice(struct proc *proc, uint start, uint end, int advice)
+{
+  struct madvrange *r, *free;
+
+  for (r = proc->madv; r < &proc->madv[NMADV]; r++)
+  {
+    if (r->advice == MADV_NORMAL || r->end <= start || r->start >= end)
+      continue;
+    if (r->start < start && r->end > end)
+    {
+      // split around the new range
+      for (free = proc->madv; free < &proc->madv[NMADV]; free++)
+        if (free->advice == MADV_NORMAL)
+          break;
+      if (free == &proc->madv[NMADV])
+        return -1;
+      free->start = end;
+      free->end = r->end;
+      free->advice = r->advice;
+      r->end = start;
+    }
+    else if (r->start < start)
+      r->end = start;
+    else if (r->end > end)
+      r->start = end;
+    else
+      r->advice = MADV_NORMAL;
+  }
+  if (advice == MADV_NORMAL)
+    return 0;
+  for (r = proc->madv; r < &proc->madv[NMADV]; r++)
+  {
+    if (r->advice == MADV_NORMAL)
+    {
+      r->start = start;
+      r->end = end;
+      r->advice = advice;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// A sequential scan just faulted on addr: queue the resident pages
+// it already passed for eviction, so they go before anything else
+// the process keeps hot, and read the next page ahead.
+static void
+seqFault(struct proc *proc, uint addr)
+{
+  struct vma *v;
+  struct freepg *pg;
+  pte_t *pte;
+  uint next;
+
+  for (pg = proc->freepages; pg < &proc->freepages[MAX_PSYC_PAGES]; pg++)
+    if (pg->va != (char *)0xffffffff && (uint)pg->va < addr &&
+        getAdvice(proc, (uint)pg->va) == MADV_SEQUENTIAL)
+      rankPage(proc, pg, 1);
+  if ((pg = findFreePage(proc, (char *)addr)) != 0)
+    rankPage(proc, pg, 0);
+
+  next = addr + PGSIZE;
+  if (getAdvice(proc, next) != MADV_SEQUENTIAL)
+    return;
+  pte = walkpgdir(proc->pgdir, (char *)next, 0);
+  if (pte != 0 && (*pte & PTE_PG))
+    swapIn(next);
+  else if ((pte == 0 || *pte == 0) && (v = findVma(proc, next)) != 0)
+    fillPage(proc, v, next);
+}
+
+// Handle a page fault at addr in the current process.
+// Returns 0 if the page is now present, -1 if the access
+// is illegal.
+int handlePageFault(uint addr)
+{
+  struct proc *proc = owner();
+  struct vma *v;
+  pte_t *pte;
+
+  addr = PGROUNDDOWN(addr);
+  if ((v = findVma(proc, addr)) == 0)
+    return -1;
+  if (proc->pgdir[PDX(addr)] & PTE_PS) // large pages are never paged out
+    return -1;
+  if ((v->flags & MAP_HUGE) && fillHuge(proc, v, addr) == 0)
+    return 0;
+  pte = walkpgdir(proc->pgdir, (char *)addr, 0);
+  if (pte == 0 || *pte == 0) // first touch, or dropped
+    return fillPage(proc, v, addr);
+  if ((*pte & PTE_PG) == 0)
+    return -1;
+  if (strcmp(proc->name, "init") == 0 || strcmp(proc->name, "sh") == 0)
+  {
+    proc->pagesInRAM++;
+    return 0;
+  }
+  swapIn(addr);
+  if (getAdvice(proc, addr) == MADV_SEQUENTIAL)
+    seqFault(proc, addr);
+  return 0;
+}
+
+// Give the pager a hint about how [addr, addr+len) will be used.
+int madvise(uint addr, uint len, int advice)
+{
+  struct proc *proc = owner();
+  struct vma *v;
+  uint a, end;
+  int n;
+  pte_t *pte;
+
+  end = PGROUNDUP(addr + len);
+  if (addr % PGSIZE != 0 || end < addr || end > vmaEnd(proc, addr))
+    return -1;
+
+  switch (advice)
+  {
+  case MADV_NORMAL:
+  case MADV_RANDOM:
+  case MADV_SEQUENTIAL:
+    return setAdvice(proc, addr, end, advice);
+
+  case MADV_WILLNEED:
+    // never prefetch more than half the pages we may keep in RAM,
+    // or the range would start evicting itself
+    n = 0;
+    for (a = addr; a < end && n < MAX_PSYC_PAGES / 2; a += PGSIZE)
+    {
+      pte = walkpgdir(proc->pgdir, (char *)a, 0);
+      if (pte != 0 && (*pte & PTE_PG) && (*pte & PTE_P) == 0)
+      {
+        swapIn(a);
+        n++;
+      }
+    }
+    return 0;
+
+  case MADV_DONTNEED:
+    if (splitRange(proc, addr, end) < 0)
+      return -1;
+    for (a = addr; a < end; a += PGSIZE)
+    {
+      if (proc->pgdir[PDX(a)] & PTE_PS)
+      {
+        // splitRange() left only large pages wholly inside the range
+        dropHuge(proc, a);
+        a += HUGEPGSIZE - PGSIZE;
+        continue;
+      }
+      pte = walkpgdir(proc->pgdir, (char *)a, 0);
+      if (pte == 0 || (*pte & PTE_U) == 0)
+        continue;
+      if ((v = findVma(proc, a)) != 0 && (v->flags & MAP_SHARED))
+        continue; // the other mappers still need the data
+      if ((*pte & PTE_P) != 0 && (*pte & PTE_PG) == 0)
+      {
+        // pieces of a split large page never joined the lists
+        if (findFreePage(proc, (char *)a) != 0)
+        {
+#ifndef NONE
+          removeFreePage(proc, (char *)a);
+#endif
+          proc->pagesInRAM--;
+        }
+        flushPage(proc, (char *)a, P2V(PTE_ADDR(*pte)));
+      }
+      else if (*pte & PTE_PG)
+        freeSwapSlot(proc, (char *)a);
+      *pte = 0;
+    }
+    shootdown(proc);
+    return 0;
+  }
+  return -1;
+}
+
+// Return the end of the run of adjacent regions of p that
+// contains addr, or 0 if addr is not in any region. Used to
+// check user pointers handed to the kernel.
+uint vmaEnd(struct proc *p, uint addr)
+{
+  struct vma *v;
+  uint end;
+
+  if ((v = findVma(p, addr)) == 0)
+    return 0;
+  for (end = v->end; ++v < &p->vmas[p->nvma] && v->start == end;)
+    end = v->end;
+  return end;
+}
+
+// Set up the regions of a fresh process whose image is the
+// sz bytes at address 0, with no executable behind them.
+int initVmas(struct proc *p, uint sz)
+{
+  struct vma *v;
+
+  if ((v = newVma(p, 0, PGROUNDUP(sz), VMA_DATA)) == 0)
+    return -1;
+  v->prot = PROT_READ | PROT_WRITE;
+  if ((v = newVma(p, PGROUNDUP(sz), PGROUNDUP(sz), VMA_HEAP)) == 0)
+    return -1;
+  v->prot = PROT_READ | PROT_WRITE;
+  return 0;
+}
+
+// Move the end of p's heap to the new program break sz.
+// Fails if the heap would shrink below its start or grow
+// into the mmap() area.
+int setBreak(struct proc *p, uint sz)
+{
+  struct vma *v;
+
+  for (v = p->vmas; v < &p->vmas[p->nvma]; v++)
+  {
+    if (v->kind != VMA_HEAP)
+      continue;
+    if (sz < v->start || sz > MMAPBASE)
+      return -1;
+    v->end = PGROUNDUP(sz);
+    return 0;
+  }
+  return -1;
+}
+
+// Return addr if [addr, addr+len) is free for a new mapping,
+// else the first free range of len bytes above it, or 0. The
+// range starts at a multiple of align, a power of two.
+static uint
+findHole(struct proc *proc, uint addr, uint len, uint align)
+{
+  struct vma *v;
+
+  addr = (addr + align - 1) & ~(align - 1);
+  for (v = proc->vmas; v < &proc->vmas[proc->nvma]; v++)
+    if (v->start < addr + len && v->end > addr)
+      addr = (v->end + align - 1) & ~(align - 1);
+  if (addr + len < addr || addr + len > KERNBASE)
+    return 0;
+  return addr;
+}
+
+// Write the page at a of shared file region v back to the
+// file if the process stored to it, without growing the file.
+static void
+writeBack(struct vma *v, uint a, pte_t pte)
+{
+  struct stat st;
+  uint off;
+  int n;
+
+  if (v->f == 0 || (pte & PTE_D) == 0)
+    return;
+  off = v->off + (a - v->start);
+  if (filestat(v->f, &st) < 0 || off >= st.size)
+    return;
+  n = st.size - off < PGSIZE ? st.size - off : PGSIZE;
+  if (filewriteat(v->f, P2V(PTE_ADDR(pte)), off, n) != n)
+    cprintf("mmap: write back to file failed\n");
+}
+
+// Unmap [start, end) of region v from the current process.
+static void
+unmapRange(struct proc *proc, struct vma *v, uint start, uint end)
+{
+  uint a;
+  pte_t *pte, old;
+
+  for (a = start; a < end; a += PGSIZE)
+  {
+    if (proc->pgdir[PDX(a)] & PTE_PS)
+    {
+      // the caller split the large pages [start, end) covers in part
+      dropHuge(proc, a);
+      a += HUGEPGSIZE - PGSIZE;
+      continue;
+    }
+    if ((pte = walkpgdir(proc->pgdir, (char *)a, 0)) == 0 || *pte == 0)
+      continue;
+    old = *pte;
+    *pte = 0;
+    if (old & PTE_PG)
+      freeSwapSlot(proc, (char *)a);
+    else if (v->flags & MAP_SHARED)
+    {
+      // no CPU may store to the page once it is written back
+      flushPage(proc, (char *)a, 0);
+      shootdown(proc);
+      writeBack(v, a, old);
+      kfree(P2V(PTE_ADDR(old)));
+    }
+    else
+    {
+      // pieces of a split large page never joined the lists
+      if (findFreePage(proc, (char *)a) != 0)
+      {
+#ifndef NONE
+        removeFreePage(proc, (char *)a);
+#endif
+        proc->pagesInRAM--;
+      }
+      flushPage(proc, (char *)a, P2V(PTE_ADDR(old)));
+    }
+  }
+  shootdown(proc);
+}
+
+// Return the number of MAP_SHARED pages proc has mapped.
+static uint
+sharedPages(struct proc *proc)
+{
+  struct vma *v;
+  uint n;
+
+  n = 0;
+  for (v = proc->vmas; v < &proc->vmas[proc->nvma]; v++)
+    if (v->kind == VMA_MMAP && (v->flags & MAP_SHARED))
+      n += (v->end - v->start) / PGSIZE;
+  return n;
+}
+
+// Map len bytes of f at offset off (or anonymous memory if
+// flags has MAP_ANONYMOUS) into the current process, at addr
+// if that range is free. Private pages are filled in on first
+// touch by the page fault handler; shared ones are populated
+// up front so that fork children share every page. They are
+// pinned, outside the paging policies, so a process may have
+// at most MAX_PSYC_PAGES of them. MAP_HUGE
+// regions, private and anonymous only, are 4MB-aligned and
+// filled with 4MB pages while 4MB blocks are free.
+// Returns the start address, or -1.
+int mmap(uint addr, uint len, int prot, int flags, struct file *f, uint off)
+{
+  struct proc *proc = owner();
+  struct vma *v;
+  uint a, align;
+
+  if (len == 0 || off % PGSIZE != 0 ||
+      ((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+    return -1;
+  if ((flags & MAP_HUGE) && (flags & (MAP_SHARED | MAP_ANONYMOUS)) != MAP_ANONYMOUS)
+    return -1;
+  if (flags & MAP_ANONYMOUS)
+    f = 0;
+  else if (f == 0 || f->type != FD_INODE || !f->readable ||
+           ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable))
+    return -1;
+
+  len = PGROUNDUP(len);
+  if ((flags & MAP_SHARED) && sharedPages(proc) + len / PGSIZE > MAX_PSYC_PAGES)
+    return -1;
+  align = (flags & MAP_HUGE) ? HUGEPGSIZE : PGSIZE;
+  if (addr % align != 0 || addr < MMAPBASE || findHole(proc, addr, len, align) != addr)
+    addr = findHole(proc, MMAPBASE, len, align);
+  if (addr == 0 || (v = newVma(proc, addr, addr + len, VMA_MMAP)) == 0)
+    return -1;
+  v->prot = prot;
+  v->flags = flags;
+  if (f)
+  {
+    v->f = filedup(f);
+    v->off = off;
+    v->filesz = len;
+  }
+  if (flags & MAP_SHARED)
+  {
+    for (a = v->start; a < v->end; a += PGSIZE)
+    {
+      if (fillPage(proc, v, a) < 0)
+      {
+        unmapRange(proc, v, v->start, a);
+        freeVma(proc, v);
+        return -1;
+      }
+    }
+  }
+  return addr;
+}
+
+// Remove the mappings of [addr, addr+len) from the current process.
+// Only mmap() regions are affected.
+int munmap(uint addr, uint len)
+{
+  struct proc *proc = owner();
+  struct vma *v, *hi;
+  uint end;
+  int i;
+
+  end = PGROUNDUP(addr + len);
+  if (addr % PGSIZE != 0 || len == 0 || end < addr)
+    return -1;
+  if (splitRange(proc, addr, end) < 0)
+    return -1;
+  for (i = 0; i < proc->nvma; i++)
+  {
+    v = &proc->vmas[i];
+    if (v->kind != VMA_MMAP || v->end <= addr || v->start >= end)
+      continue;
+    if (v->start < addr && v->end > end)
+    {
+      // punching a hole: the part above it needs a region of its own
+      if ((hi = newVma(proc, end, v->end, VMA_MMAP)) == 0)
+        return -1;
+      unmapRange(proc, v, addr, end);
+      *hi = *v;
+      if (hi->f)
+        filedup(hi->f);
+      trimVma(hi, end, v->end);
+      trimVma(v, v->start, addr);
+      i++;
+      continue;
+    }
+    unmapRange(proc, v, v->start > addr ? v->start : addr,
+               v->end < end ? v->end : end);
+    if (v->start < addr)
+      trimVma(v, v->start, addr);
+    else if (v->end > end)
+      trimVma(v, end, v->end);
+    else
+    {
+      freeVma(proc, v);
+      i--;
+    }
+  }
+  return 0;
+}
+
+// Give fork child np the regions of p. Pages of mmap() regions,
+// which copyuvm() does not see, are mapped into np too if shared
+// and copied if private; swapped out private pages travel with
+// the swap file.
+int forkVmas(struct proc *np, struct proc *p)
+{
+  struct vma *v;
+  uint a;
+  pte_t *pte;
+  char *mem;
+
+  for (v = p->vmas; v < &p->vmas[p->nvma]; v++)
+  {
+    if (v->kind != VMA_MMAP)
+      continue;
+    for (a = v->start; a < v->end; a += PGSIZE)
+    {
+      if (p->pgdir[PDX(a)] & PTE_PS)
+      {
+        if (copyHuge(np->pgdir, a, p->pgdir[PDX(a)]) < 0)
+          return -1;
+        a += HUGEPGSIZE - PGSIZE;
+        continue;
+      }
+      if ((pte = walkpgdir(p->pgdir, (char *)a, 0)) == 0 || *pte == 0)
+        continue;
+      if (*pte & PTE_PG)
+      {
+        if (mappages(np->pgdir, (char *)a, PGSIZE, 0, PTE_FLAGS(*pte)) < 0)
+          return -1;
+        continue;
+      }
+      if (v->flags & MAP_SHARED)
+      {
+        mem = P2V(PTE_ADDR(*pte));
+        kdup(mem);
+      }
+      else
+      {
+        if ((mem = kalloc()) == 0)
+          return -1;
+        memmove(mem, P2V(PTE_ADDR(*pte)), PGSIZE);
+      }
+      if (mappages(np->pgdir, (char *)a, PGSIZE, V2P(mem), PTE_FLAGS(*pte)) < 0)
+      {
+        kfree(mem);
+        return -1;
+      }
+    }
+  }
+  memmove(np->vmas, p->vmas, sizeof(p->vmas));
+  np->nvma = p->nvma;
+  for (v = np->vmas; v < &np->vmas[np->nvma]; v++)
+  {
+    if (v->f)
+      filedup(v->f);
+    if (v->ip)
+      idup(v->ip);
+  }
+  return 0;
+}
+
+// Add up the user memory that pgdir maps, in bytes. A resident
+// frame counts in full towards rss, and divided by its number of
+// users towards pss. Only reads the entries: a frame's epoch is
+// left to the paging code.
+void memusage(pde_t *pgdir, struct memstat *ms)
+{
+  pde_t *pde;
+  pte_t *pgtab, *pte;
+  struct frame *f;
+
+  memset(ms, 0, sizeof(*ms));
+  for (pde = pgdir; pde < &pgdir[PDX(KERNBASE)]; pde++)
+  {
+    if (*pde & PTE_PS)
+    {
+      ms->rss += HUGEPGSIZE;
+      ms->pss += HUGEPGSIZE;
+      continue;
+    }
+    if ((*pde & PTE_P) == 0)
+      continue;
+    pgtab = (pte_t *)P2V(PTE_ADDR(*pde));
+    for (pte = pgtab; pte < &pgtab[NPTENTRIES]; pte++)
+    {
+      if ((*pte & PTE_P) && PTE_ADDR(*pte) < phystop)
+      {
+        f = &frames[PTE_ADDR(*pte) / PGSIZE];
+        ms->rss += PGSIZE;
+        if (f->mapcount > 1)
+        {
+          ms->pss += PGSIZE / f->mapcount;
+          ms->shared += PGSIZE;
+        }
+        else
+          ms->pss += PGSIZE;
+      }
+      else if (*pte & PTE_PG)
+        ms->swapped += PGSIZE;
+    }
+  }
+}
+
+// Drop all of p's regions, whose pages are mapped in pgdir.
+// Dirty shared file pages are written back; the frames themselves
+// go away with pgdir.
+void freeVmas(struct proc *p, pde_t *pgdir)
+{
+  struct vma *v;
+  uint a;
+  pte_t *pte;
+
+  for (v = p->vmas; v < &p->vmas[p->nvma]; v++)
+    if (v->flags & MAP_SHARED)
+      for (a = v->start; a < v->end; a += PGSIZE)
+        if ((pte = walkpgdir(pgdir, (char *)a, 0)) != 0 && (*pte & PTE_P))
+          writeBack(v, a, *pte);
+  while (p->nvma > 0)
+    freeVma(p, &p->vmas[p->nvma - 1]);
+}
+
 //PAGEBREAK!
 // Blank page.
 //PAGEBREAK!